@@ -0,0 +1,358 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#ifndef CPULIMIT_PATH
+#define CPULIMIT_PATH "./cpulimit"
+#endif
+
+namespace consts {
+constexpr auto kSampleInterval = std::chrono::milliseconds(100);
+constexpr auto kWarmup = std::chrono::seconds(1);
+constexpr auto kTracedRun = std::chrono::seconds(2);
+constexpr auto kBurst = std::chrono::milliseconds(50);
+constexpr auto kPause = std::chrono::milliseconds(150);
+constexpr auto kChildLifetime = std::chrono::milliseconds(20);
+constexpr int64_t kGapThresholdNs = 1000000;
+constexpr int kGapBuckets = 2000;
+constexpr int kThreads = 4;
+constexpr int kCpuFlushIterations = 1024;
+constexpr double kHundredPercent = 100.0;
+}  // namespace consts
+
+// Lives in a MAP_SHARED mapping created before the burners fork, so every
+// burner thread and forked child reports into the same counters.
+struct SharedStats {
+    // Gaps are only recorded once the warm-up is over.
+    std::atomic<bool> recording;
+    std::atomic<int64_t> cpu_ns;
+    std::atomic<int64_t> gap_count;
+    std::atomic<int64_t> max_gap_ns;
+    // 1 ms buckets; the last one collects everything longer.
+    std::atomic<int64_t> gap_histogram[consts::kGapBuckets];
+
+    void RecordGap(int64_t gap_ns) {
+        ++gap_count;
+        ++gap_histogram[std::min<int64_t>(gap_ns / 1000000, consts::kGapBuckets - 1)];
+        int64_t max = max_gap_ns;
+        while (gap_ns > max && !max_gap_ns.compare_exchange_weak(max, gap_ns)) {
+        }
+    }
+
+    // Percentile of the gap lengths in ms, rounded up to the bucket edge.
+    int64_t GapPercentile(double fraction) const {
+        int64_t rank = static_cast<int64_t>(std::ceil(fraction * gap_count));
+        int64_t seen = 0;
+        for (int i = 0; i < consts::kGapBuckets; ++i) {
+            seen += gap_histogram[i];
+            if (seen >= rank && seen > 0) {
+                return i + 1;
+            }
+        }
+        return 0;
+    }
+};
+
+SharedStats* shared = nullptr;
+
+int64_t ClockNs(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Busy loop for `duration` (forever if zero). A jump in wall time between two
+// iterations is time the thread did not run, i.e. a stop window (or plain
+// preemption); the thread's own CPU time is published every few iterations.
+void Spin(std::chrono::nanoseconds duration) {
+    int64_t start = ClockNs(CLOCK_MONOTONIC);
+    int64_t last = start;
+    int64_t cpu_last = ClockNs(CLOCK_THREAD_CPUTIME_ID);
+    for (int64_t iteration = 1;; ++iteration) {
+        int64_t now = ClockNs(CLOCK_MONOTONIC);
+        if (now - last >= consts::kGapThresholdNs && shared->recording) {
+            shared->RecordGap(now - last);
+        }
+        last = now;
+        bool done = duration.count() != 0 && now - start >= duration.count();
+        if (done || iteration % consts::kCpuFlushIterations == 0) {
+            int64_t cpu = ClockNs(CLOCK_THREAD_CPUTIME_ID);
+            shared->cpu_ns += cpu - cpu_last;
+            cpu_last = cpu;
+        }
+        if (done) {
+            return;
+        }
+    }
+}
+
+struct Workload {
+    const char* name;
+    void (*run)();
+};
+
+// "bursty" only wants a quarter of a CPU, so above a 25% limit it should run
+// unthrottled and its error column measures the idle time, not the limiter.
+// "idle" never runs; its row is the bare cost of watching a target.
+const Workload kWorkloads[] = {
+    {"idle",
+     [] {
+         while (true) {
+             pause();
+         }
+     }},
+    {"single", [] { Spin({}); }},
+    {"threads",
+     [] {
+         std::vector<std::thread> threads;
+         for (int i = 0; i < consts::kThreads; ++i) {
+             threads.emplace_back([] { Spin({}); });
+         }
+         threads.front().join();
+     }},
+    {"bursty",
+     [] {
+         while (true) {
+             Spin(consts::kBurst);
+             std::this_thread::sleep_for(consts::kPause);
+         }
+     }},
+    {"forking",
+     [] {
+         while (true) {
+             pid_t child = fork();
+             if (child == 0) {
+                 Spin(consts::kChildLifetime);
+                 _exit(0);
+             }
+             waitpid(child, nullptr, 0);
+         }
+     }},
+};
+
+pid_t SpawnBurner(const Workload& workload) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        setpgid(0, 0);
+        std::string comm = std::string("clb_") + workload.name;
+        prctl(PR_SET_NAME, comm.c_str());
+        workload.run();
+        _exit(0);
+    }
+    return pid;
+}
+
+pid_t SpawnCpulimit(const Workload& workload, int limit, const std::vector<std::string>& extra,
+                    bool traced) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        }
+        std::vector<std::string> args = {CPULIMIT_PATH, "-e", std::string("clb_") + workload.name,
+                                         "-l", std::to_string(limit)};
+        args.insert(args.end(), extra.begin(), extra.end());
+        std::vector<char*> argv;
+        for (auto& arg : args) {
+            argv.push_back(arg.data());
+        }
+        argv.push_back(nullptr);
+        execv(CPULIMIT_PATH, argv.data());
+        _exit(127);
+    }
+    return pid;
+}
+
+void KillBurner(pid_t pid) {
+    kill(-pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+}
+
+struct CaseResult {
+    double achieved = 0.0;
+    double error_p50 = 0.0;
+    double error_p95 = 0.0;
+    int64_t stop_p50_ms = 0;
+    int64_t stop_p99_ms = 0;
+    int64_t stop_max_ms = 0;
+    double self_cpu = 0.0;
+};
+
+double Percentile(std::vector<double> values, double fraction) {
+    if (values.empty()) {
+        return 0.0;
+    }
+    std::sort(values.begin(), values.end());
+    return values[std::min(values.size() - 1, static_cast<size_t>(fraction * values.size()))];
+}
+
+// Samples the burners' CPU once per interval; after the warm-up each sample's
+// deviation from the limit goes into the error distribution.
+CaseResult RunCase(const Workload& workload, int limit, const std::vector<std::string>& extra,
+                   std::chrono::seconds duration) {
+    new (shared) SharedStats();
+    pid_t burner = SpawnBurner(workload);
+    auto start = std::chrono::steady_clock::now();
+    pid_t cpulimit = SpawnCpulimit(workload, limit, extra, false);
+
+    std::vector<double> errors;
+    int64_t warm_cpu_ns = 0;
+    auto warm_time = start;
+    int64_t last_cpu_ns = 0;
+    auto next = start + consts::kSampleInterval;
+    for (; next <= start + duration; next += consts::kSampleInterval) {
+        std::this_thread::sleep_until(next);
+        int64_t cpu_ns = shared->cpu_ns;
+        if (next <= start + consts::kWarmup) {
+            warm_cpu_ns = cpu_ns;
+            warm_time = next;
+            shared->recording = true;
+        } else {
+            double usage = static_cast<double>(cpu_ns - last_cpu_ns) /
+                           std::chrono::nanoseconds(consts::kSampleInterval).count();
+            errors.push_back(std::abs(usage * consts::kHundredPercent - limit));
+        }
+        last_cpu_ns = cpu_ns;
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    kill(cpulimit, SIGTERM);
+    int status;
+    struct rusage usage;
+    wait4(cpulimit, &status, 0, &usage);
+    KillBurner(burner);
+
+    CaseResult result;
+    double measured_secs = std::chrono::duration<double>(end - warm_time).count();
+    result.achieved = static_cast<double>(last_cpu_ns - warm_cpu_ns) / 1e9 / measured_secs *
+                      consts::kHundredPercent;
+    result.error_p50 = Percentile(errors, 0.5);
+    result.error_p95 = Percentile(errors, 0.95);
+    result.stop_p50_ms = shared->GapPercentile(0.5);
+    result.stop_p99_ms = shared->GapPercentile(0.99);
+    result.stop_max_ms = shared->max_gap_ns / 1000000;
+    double self_secs = usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+                       usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+    double wall_secs = std::chrono::duration<double>(end - start).count();
+    result.self_cpu = self_secs / wall_secs * consts::kHundredPercent;
+    return result;
+}
+
+// Counts cpulimit's syscalls with ptrace in a separate run, so tracing
+// overhead does not pollute the accuracy numbers. Startup and the warm-up are
+// not counted. Returns -1 if tracing is not permitted here.
+double CountSyscallsPerSec(const Workload& workload, int limit,
+                           const std::vector<std::string>& extra) {
+    pid_t burner = SpawnBurner(workload);
+    pid_t pid = SpawnCpulimit(workload, limit, extra, true);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        KillBurner(burner);
+        return -1;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    auto counted_from = start + consts::kWarmup;
+    bool terminated = false;
+    int64_t stops = 0;
+    int pending_signal = 0;
+    while (true) {
+        ptrace(PTRACE_SYSCALL, pid, nullptr, pending_signal);
+        pending_signal = 0;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            stops += now >= counted_from;
+        } else if (WSTOPSIG(status) != SIGTRAP) {
+            pending_signal = WSTOPSIG(status);
+        }
+        if (!terminated && now - counted_from >= consts::kTracedRun) {
+            kill(pid, SIGTERM);
+            terminated = true;
+        }
+    }
+    KillBurner(burner);
+    return stops / 2 / std::chrono::duration<double>(consts::kTracedRun).count();
+}
+
+// Usage: bench_cpulimit [--seconds=N] [cpulimit options...] [limit...]
+// Options such as --backend=cgroup or --period=20 are passed to cpulimit, so
+// backends and controller settings can be compared run against run.
+int main(int argc, char** argv) {
+    std::vector<int> limits;
+    std::vector<std::string> extra;
+    std::chrono::seconds duration(6);
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--seconds=", 0) == 0) {
+            duration = std::chrono::seconds(std::atoi(arg.c_str() + 10));
+        } else if (arg.rfind("--", 0) == 0) {
+            extra.push_back(arg);
+        } else {
+            limits.push_back(std::atoi(arg.c_str()));
+        }
+    }
+    if (limits.empty()) {
+        limits = {10, 25, 50};
+    }
+    void* mapping = mmap(nullptr, sizeof(SharedStats), PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED) {
+        std::perror("mmap");
+        return EXIT_FAILURE;
+    }
+    shared = static_cast<SharedStats*>(mapping);
+
+    std::printf("%-8s %6s %9s %8s %8s %8s %8s %8s %9s %10s\n", "WORKLOAD", "LIMIT", "ACHIEVED",
+                "ERR_P50", "ERR_P95", "STOP_P50", "STOP_P99", "STOP_MAX", "SELF_CPU",
+                "SYSCALLS/S");
+    for (const Workload& workload : kWorkloads) {
+        for (int limit : limits) {
+            CaseResult result = RunCase(workload, limit, extra, duration);
+            double syscalls = CountSyscallsPerSec(workload, limit, extra);
+            std::string syscalls_text =
+                syscalls < 0 ? "n/a" : std::to_string(std::lround(syscalls));
+            std::printf("%-8s %5d%% %8.1f%% %7.1f%% %7.1f%% %6ldms %6ldms %6ldms %8.2f%% %10s\n",
+                        workload.name, limit, result.achieved, result.error_p50, result.error_p95,
+                        static_cast<long>(result.stop_p50_ms),
+                        static_cast<long>(result.stop_p99_ms),
+                        static_cast<long>(result.stop_max_ms), result.self_cpu,
+                        syscalls_text.c_str());
+            std::fflush(stdout);
+        }
+    }
+    return 0;
+}
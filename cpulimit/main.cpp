@@ -1,225 +1,1304 @@
-
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
+#include <fcntl.h>
 #include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
 #include <signal.h>
+#include <sstream>
 #include <string>
 #include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
-namespace errors {
-void Report(const std::string& context, const std::string& message = "") {
-    std::fprintf(stderr, "ERROR %s: %s\n", context.c_str(),
-                 message.empty() ? "unknown error" : message.c_str());
-}
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 
-void Exit(const std::string& context, const std::string& message = "") {
-    Report(context, message);
-    std::exit(EXIT_FAILURE);
-}
-}  // namespace errors
+#include "src/cgroup_throttle.h"
+#include "src/duty_controller.h"
+#include "src/errors.h"
+#include "src/process_clock.h"
+#include "src/process_tree.h"
 
 namespace consts {
 const double kHundredPercent = 100.0;
-const int64_t kTicksPerSec = sysconf(_SC_CLK_TCK);
+const auto kCgroupPollInterval = std::chrono::seconds(1);
+const auto kDefaultPeriod = std::chrono::milliseconds(100);
+const auto kMinPeriod = std::chrono::milliseconds(10);
+const auto kMaxPeriod = std::chrono::milliseconds(1000);
+const auto kMinRunTime = std::chrono::microseconds(200);
+const auto kMaxIdleInterval = std::chrono::milliseconds(1000);
+const double kIdleUsageRatio = 0.5;
+const int kMaxEvents = 64;
+const int kListenBacklog = 16;
+const size_t kControlLineLimit = 4096;
+const size_t kControlOutputLimit = 1024 * 1024;
+const size_t kTelemetryRecords = 600;
+const int kUsageBuckets = 400;
 }  // namespace consts
 
-std::vector<int> all_pids;
+// The one epoll instance behind every wait: a timerfd armed with absolute
+// CLOCK_MONOTONIC deadlines (what steady_clock reads), so late wakeups do not
+// push back the following ones, plus any number of watched fds such as the
+// targets' pidfds, whose callbacks run while waiting.
+class EventLoop {
+public:
+    EventLoop() {
+        epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+        timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (epoll_fd_ < 0 || timer_fd_ < 0) {
+            errors::Exit("EventLoop", std::string("epoll/timerfd: ") + std::strerror(errno));
+        }
+        Register(timer_fd_);
+    }
 
-class CpuLimit {
+    EventLoop(const EventLoop&) = delete;
+    EventLoop& operator=(const EventLoop&) = delete;
+
+    ~EventLoop() {
+        close(timer_fd_);
+        close(epoll_fd_);
+    }
+
+    void Watch(int fd, std::function<void()> on_ready, uint32_t events = EPOLLIN) {
+        callbacks_[fd] = std::move(on_ready);
+        Register(fd, events);
+    }
+
+    void Modify(int fd, uint32_t events) {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event) != 0) {
+            errors::Exit("EventLoop", std::string("epoll_ctl: ") + std::strerror(errno));
+        }
+    }
+
+    void Unwatch(int fd) {
+        epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+        callbacks_.erase(fd);
+    }
+
+    // Dispatches events until the deadline, or until `done` holds after one.
+    void WaitUntil(std::chrono::steady_clock::time_point deadline,
+                   const std::function<bool()>& done) {
+        if (done() || deadline <= std::chrono::steady_clock::now()) {
+            return;
+        }
+        auto since_epoch = deadline.time_since_epoch();
+        auto secs = std::chrono::duration_cast<std::chrono::seconds>(since_epoch);
+        struct itimerspec spec = {};
+        spec.it_value.tv_sec = secs.count();
+        spec.it_value.tv_nsec = std::chrono::nanoseconds(since_epoch - secs).count();
+        if (timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &spec, nullptr) != 0) {
+            errors::Exit("WaitUntil", std::string("timerfd_settime: ") + std::strerror(errno));
+        }
+
+        struct epoll_event events[consts::kMaxEvents];
+        while (true) {
+            int ready = epoll_wait(epoll_fd_, events, consts::kMaxEvents, -1);
+            if (ready < 0 && errno != EINTR) {
+                errors::Exit("WaitUntil", std::string("epoll_wait: ") + std::strerror(errno));
+            }
+            bool expired = false;
+            for (int i = 0; i < ready; ++i) {
+                int fd = events[i].data.fd;
+                if (fd == timer_fd_) {
+                    uint64_t expirations;
+                    read(timer_fd_, &expirations, sizeof(expirations));
+                    expired = true;
+                    continue;
+                }
+                // The callback may unwatch its own fd, so it runs from a copy.
+                auto it = callbacks_.find(fd);
+                if (it != callbacks_.end()) {
+                    auto callback = it->second;
+                    callback();
+                }
+            }
+            if (expired || done()) {
+                return;
+            }
+        }
+    }
+
+private:
+    void Register(int fd, uint32_t events = EPOLLIN) {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.fd = fd;
+        if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) != 0) {
+            errors::Exit("EventLoop", std::string("epoll_ctl: ") + std::strerror(errno));
+        }
+    }
+
+    int epoll_fd_ = -1;
+    int timer_fd_ = -1;
+    std::unordered_map<int, std::function<void()>> callbacks_;
+};
+
+struct GroupSpec {
+    enum class Kind { kPid, kExec, kCgroup };
+
+    Kind kind = Kind::kPid;
+    std::string target;
+    double limit_fraction = 0.0;
+    // Groups selected by name or cgroup keep waiting for new members instead of
+    // finishing once they are empty.
+    bool persistent = false;
+    // Split the budget between members by weight instead of giving every
+    // member the same duty; unlisted members weigh 1.
+    bool fair = false;
+    std::map<int, double> weights;
+    // For pid groups: also limit every descendant of the pid.
+    bool include_children = false;
+};
+
+class TargetGroup;
+
+// A SIGCONT or SIGSTOP for one member, due at `offset` into the period.
+struct SignalEdge {
+    std::chrono::nanoseconds offset;
+    TargetGroup* group;
+    int pid;
+    int signal_num;
+};
+
+// Members of one limited group, each held by a pidfd: signals go through the
+// pidfd so they can never hit a recycled pid, and exits are picked up by the
+// event loop instead of rescanning /proc.
+class TargetGroup {
 public:
-    CpuLimit(int argc, char** argv) {
-        std::atexit(CleanUp);
-        signal(SIGINT, SignalHandler);
-        signal(SIGTERM, SignalHandler);
+    TargetGroup(GroupSpec spec, EventLoop& loop)
+        : spec_(std::move(spec)), loop_(loop), controller_(spec_.limit_fraction) {
+    }
 
-        CommandInfo cmd;
-        if (argc != 5) {
-            ExitWithUsage();
+    TargetGroup(const TargetGroup&) = delete;
+    TargetGroup& operator=(const TargetGroup&) = delete;
+
+    ~TargetGroup() {
+        for (const auto& [pid, member] : members_) {
+            loop_.Unwatch(member.pidfd);
+            close(member.pidfd);
         }
-        if (std::string(argv[3]) != "-l") {
-            ExitWithUsage();
+    }
+
+    const GroupSpec& Spec() const {
+        return spec_;
+    }
+
+    DutyController& Controller() {
+        return controller_;
+    }
+
+    void SetLimit(double limit_fraction) {
+        spec_.limit_fraction = limit_fraction;
+        controller_.SetLimit(limit_fraction);
+    }
+
+    std::vector<int> Pids() const {
+        std::vector<int> pids;
+        for (const auto& [pid, member] : members_) {
+            pids.push_back(pid);
         }
-        if (std::atoi(argv[4]) <= 0) {
-            ExitWithUsage();
+        return pids;
+    }
+
+    bool Add(int pid) {
+        if (members_.count(pid) != 0) {
+            return true;
+        }
+        int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        if (pidfd < 0) {
+            return false;
+        }
+        Member& member = members_.try_emplace(pid, pidfd, pid).first->second;
+        member.clock.TakeDiff();
+        auto weight = spec_.weights.find(pid);
+        if (weight != spec_.weights.end()) {
+            member.weight = weight->second;
+        }
+        loop_.Watch(pidfd, [this, pid] { Remove(pid); });
+        return true;
+    }
+
+    void Remove(int pid) {
+        auto it = members_.find(pid);
+        if (it != members_.end()) {
+            loop_.Unwatch(it->second.pidfd);
+            close(it->second.pidfd);
+            members_.erase(it);
         }
+    }
 
-        cmd.limit_fraction = std::atoi(argv[4]) / consts::kHundredPercent;
-        if (std::string(argv[1]) == "-p") {
-            cmd.pid = std::atoi(argv[2]);
-            RunCpuLimitByPid(cmd);
+    bool Empty() const {
+        return members_.empty();
+    }
 
-        } else if (std::string(argv[1]) == "-e") {
-            cmd.exec_filename = argv[2];
-            RunCpuLimitByExec(cmd);
+    size_t Size() const {
+        return members_.size();
+    }
+
+    // Member-time the last plan keeps stopped within one period.
+    std::chrono::nanoseconds StoppedTime(std::chrono::nanoseconds period) const {
+        std::chrono::nanoseconds stopped{0};
+        for (const auto& [pid, member] : members_) {
+            stopped += period - std::clamp(member.run_time, std::chrono::nanoseconds(0), period);
         }
-        ExitWithUsage();
+        return stopped;
     }
 
-private:
-    static void CleanUp() {
-        for (int pid : all_pids) {
-            kill(pid, SIGCONT);
+    bool Finished() const {
+        return members_.empty() && !spec_.persistent;
+    }
+
+    void Signal(int signal_num) {
+        for (auto& [pid, member] : members_) {
+            SendSignal(member, signal_num);
         }
-        std::printf("\nCpulimit Exit\n");
     }
 
-    static void SignalHandler(int signal_num) {
-        std::exit(signal_num);
+    void SignalMember(int pid, int signal_num) {
+        auto it = members_.find(pid);
+        if (it != members_.end()) {
+            SendSignal(it->second, signal_num);
+        }
     }
 
-    void ExitWithUsage() {
-        std::fprintf(stderr,
-                     "Usage:\n"
-                     "  cpulimit -p <pid> -l <limit_percentage>\n"
-                     "  cpulimit -e <executable_name> -l <limit_percentage>\n");
-        _exit(EXIT_FAILURE);
+    // Appends this period's edges. Member i of n runs for its run time starting
+    // at i/n of the period, wrapping past its end, so the stop windows are
+    // spread over the period instead of the whole group freezing and bursting
+    // at once; each member still runs its full share of every period. Only
+    // state changes are signalled. Returns whether any member is stopped for
+    // part of the period.
+    bool PlanPeriod(std::chrono::nanoseconds period, std::vector<SignalEdge>& edges) {
+        if (spec_.fair) {
+            PlanFairShares(period);
+        } else {
+            auto run_time =
+                std::chrono::duration_cast<std::chrono::nanoseconds>(period * controller_.Duty());
+            for (auto& [pid, member] : members_) {
+                member.run_time = run_time;
+            }
+        }
+
+        auto count = static_cast<int64_t>(members_.size());
+        int64_t index = 0;
+        bool throttled = false;
+        for (auto& [pid, member] : members_) {
+            // SIGCONT lets the target preempt cpulimit until the next tick, so a
+            // window too short to be honoured is skipped and left to the controller.
+            if (member.run_time < consts::kMinRunTime) {
+                member.run_time = std::chrono::nanoseconds(0);
+            }
+            auto run_time = member.run_time;
+            throttled = throttled || run_time < period;
+            auto start = period * index++ / count;
+            bool run_at_zero = run_time >= period || (period - start) % period < run_time;
+            if (run_at_zero == member.stopped) {
+                edges.push_back({{}, this, pid, run_at_zero ? SIGCONT : SIGSTOP});
+            }
+            if (run_time <= std::chrono::nanoseconds(0) || run_time >= period) {
+                continue;
+            }
+            if (start.count() > 0) {
+                edges.push_back({start, this, pid, SIGCONT});
+            }
+            auto stop = (start + run_time) % period;
+            if (stop.count() > 0) {
+                edges.push_back({stop, this, pid, SIGSTOP});
+            }
+        }
+        return throttled;
     }
 
-    struct CommandInfo {
+    // Sums per-member deltas against the previous call, so members joining or
+    // leaving in between do not show up as a jump in usage.
+    int64_t TakeRuntimeDiff() {
+        int64_t diff = 0;
+        for (auto& [pid, member] : members_) {
+            int64_t member_diff = member.clock.TakeDiff();
+            double run_secs = std::chrono::duration<double>(member.run_time).count();
+            if (run_secs > 0) {
+                double demand = static_cast<double>(member_diff) / consts::kNsecPerSec / run_secs;
+                member.demand += consts::kDemandSmoothing * (demand - member.demand);
+            }
+            diff += member_diff;
+        }
+        return diff;
+    }
+
+    // Adds whatever joined the cgroup since the previous call; leavers are
+    // only dropped when they exit. Returns whether anything joined.
+    bool SyncCgroup() {
+        std::ifstream procs(spec_.target + "/cgroup.procs");
+        bool joined = false;
         int pid;
-        std::string exec_filename;
-        double limit_fraction;
+        while (procs >> pid) {
+            if (members_.count(pid) == 0 && Add(pid)) {
+                joined = true;
+            }
+        }
+        return joined;
+    }
+
+private:
+    struct Member {
+        Member(int pidfd, int pid) : pidfd(pidfd), clock(pid) {
+        }
+
+        int pidfd;
+        ProcessClock clock;
+        bool stopped = false;
+        double weight = 1.0;
+        // CPU per second of running, like the group's demand.
+        double demand = 1.0;
+        std::chrono::nanoseconds run_time{0};
     };
 
-    int64_t GetProcessCpuUsage(int pid) {
-        std::string file_path = "/proc/" + std::to_string(pid) + "/stat";
-        std::ifstream file(file_path);
-        if (!file.is_open()) {
-            errors::Exit("GetProcessStats", "open " + file_path);
+    // Water-filling split of the group's budget: each round offers every
+    // pending member its weighted share of what is left; members whose demand
+    // would not use it are let run freely and drop out, and their unused share
+    // goes to the busier members in the next round.
+    void PlanFairShares(std::chrono::nanoseconds period) {
+        double period_secs = std::chrono::duration<double>(period).count();
+        double budget_secs = controller_.Budget() * period_secs;
+        std::vector<Member*> pending;
+        for (auto& [pid, member] : members_) {
+            pending.push_back(&member);
+        }
+        bool changed = true;
+        while (changed && !pending.empty()) {
+            changed = false;
+            double round_budget_secs = budget_secs;
+            double total_weight = 0;
+            for (const Member* member : pending) {
+                total_weight += member->weight;
+            }
+            std::erase_if(pending, [&](Member* member) {
+                double share_secs = round_budget_secs * member->weight / total_weight;
+                double want_secs = member->demand * period_secs;
+                if (want_secs > share_secs) {
+                    return false;
+                }
+                member->run_time = period;
+                budget_secs -= want_secs;
+                changed = true;
+                return true;
+            });
+        }
+        double total_weight = 0;
+        for (const Member* member : pending) {
+            total_weight += member->weight;
         }
-        std::string skip;
-        std::getline(file, skip, ')');
+        for (Member* member : pending) {
+            double share_secs = budget_secs * member->weight / total_weight;
+            double demand = std::max(member->demand, consts::kMinDemand);
+            double run_secs = std::min(period_secs, share_secs / demand);
+            member->run_time = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::duration<double>(run_secs));
+        }
+    }
+
+    static void SendSignal(Member& member, int signal_num) {
+        syscall(SYS_pidfd_send_signal, member.pidfd, signal_num, nullptr, 0);
+        member.stopped = signal_num == SIGSTOP;
+    }
 
-        for (int i = 0; i < 11; ++i) {
-            file >> skip;
+    GroupSpec spec_;
+    EventLoop& loop_;
+    DutyController controller_;
+    std::map<int, Member> members_;
+};
+
+// Local control socket served from the event loop. Clients send one command
+// per line; every reply ends with an "ok" or "error <reason>" line.
+class ControlServer {
+public:
+    using Handler = std::function<std::string(const std::string&)>;
+
+    ControlServer(const std::string& path, EventLoop& loop, Handler handler)
+        : loop_(loop), handler_(std::move(handler)) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            errors::Exit("ControlServer", "bad unix socket path " + path);
         }
+        std::strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
 
-        int64_t utime, stime;
-        if (file >> utime >> stime) {
-            return utime + stime;
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 ||
+            bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd_, consts::kListenBacklog) != 0) {
+            errors::Exit("ControlServer", "listen on " + path + ": " + std::strerror(errno));
         }
-        errors::Exit("GetProcessStats", "read from " + file_path);
-        return -1;
+        path_ = path;
+        loop_.Watch(listen_fd_, [this] { Accept(); });
     }
 
-    std::vector<int> GetPidsByExec(const std::string& executable_name) {
-        std::vector<int> pids;
+    ControlServer(const ControlServer&) = delete;
+    ControlServer& operator=(const ControlServer&) = delete;
 
-        DIR* dir = opendir("/proc");
-        if (dir == nullptr) {
-            errors::Exit("GetAllPids", "opendir /proc");
-            return pids;
-        }
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            int pid = 0;
-            if (sscanf(entry->d_name, "%d", &pid) == 1) {
-                std::ifstream file("/proc/" + std::to_string(pid) + "/comm");
-                if (!file.is_open()) {
-                    continue;
-                }
-                std::string process_name;
-                if (file >> process_name) {
-                    if (process_name == executable_name) {
-                        pids.push_back(pid);
-                    }
-                }
+    ~ControlServer() {
+        for (const auto& [fd, client] : clients_) {
+            loop_.Unwatch(fd);
+            close(fd);
+        }
+        loop_.Unwatch(listen_fd_);
+        close(listen_fd_);
+        unlink(path_.c_str());
+    }
+
+private:
+    struct Client {
+        std::string input;
+        std::string output;
+        bool eof = false;
+        uint32_t events = EPOLLIN;
+    };
+
+    void Accept() {
+        int client = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client < 0) {
+            return;
+        }
+        clients_[client];
+        loop_.Watch(client, [this, client] { Serve(client); });
+    }
+
+    // Clients are non-blocking, so a slow or stuck one cannot hold up the
+    // limiter. Replies the socket cannot take yet, such as a long history,
+    // wait in the client's output buffer and go out as it turns writable; a
+    // client that lets that buffer grow past kControlOutputLimit, or sends an
+    // overlong line, is dropped. After EOF the pending replies are still sent.
+    void Serve(int fd) {
+        Client& client = clients_[fd];
+        char chunk[consts::kControlLineLimit];
+        while (!client.eof) {
+            ssize_t size = read(fd, chunk, sizeof(chunk));
+            if (size < 0 && errno == EINTR) {
+                continue;
+            }
+            if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (size < 0) {
+                Drop(fd);
+                return;
+            }
+            client.eof = size == 0;
+            client.input.append(chunk, size);
+            size_t end;
+            while ((end = client.input.find('\n')) != std::string::npos) {
+                client.output += handler_(client.input.substr(0, end));
+                client.input.erase(0, end + 1);
+            }
+            if (client.input.size() > consts::kControlLineLimit ||
+                client.output.size() > consts::kControlOutputLimit) {
+                Drop(fd);
+                return;
             }
         }
-        closedir(dir);
-        return pids;
+        while (!client.output.empty()) {
+            ssize_t sent = send(fd, client.output.data(), client.output.size(),
+                                MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            if (sent < 0) {
+                Drop(fd);
+                return;
+            }
+            client.output.erase(0, sent);
+        }
+        if (client.eof && client.output.empty()) {
+            Drop(fd);
+            return;
+        }
+        uint32_t events = 0;
+        if (!client.eof) {
+            events |= EPOLLIN;
+        }
+        if (!client.output.empty()) {
+            events |= EPOLLOUT;
+        }
+        if (events != client.events) {
+            client.events = events;
+            loop_.Modify(fd, events);
+        }
     }
 
-    int64_t GetTotalCpuUsage(const std::vector<int>& pids) {
-        int64_t total_usage = 0;
-        for (int pid : pids) {
-            total_usage += GetProcessCpuUsage(pid);
+    void Drop(int fd) {
+        loop_.Unwatch(fd);
+        close(fd);
+        clients_.erase(fd);
+    }
+
+    EventLoop& loop_;
+    Handler handler_;
+    std::string path_;
+    int listen_fd_ = -1;
+    std::map<int, Client> clients_;
+};
+
+// Per-period history of every group: the last kTelemetryRecords periods in a
+// ring for the control socket, a histogram of usage against the limit for
+// the exit summary, and optionally one CSV line per period. All of it lives
+// in memory allocated up front and is only touched from the control loop, so
+// recording a period costs a copy and a buffered write.
+class Telemetry {
+public:
+    struct Record {
+        double time_secs = 0.0;
+        // All in CPUs over the period: the limit, what the controller granted
+        // and what the group actually used.
+        double limit = 0.0;
+        double budget = 0.0;
+        double usage = 0.0;
+        // Summed over members, so two members stopped for the whole period
+        // count twice.
+        double stopped_secs = 0.0;
+        size_t members = 0;
+    };
+
+    ~Telemetry() {
+        if (log_ != nullptr) {
+            std::fclose(log_);
         }
-        return total_usage;
     }
 
-    double CountElapsedTime(const std::chrono::steady_clock::time_point& start,
-                            const std::chrono::steady_clock::time_point& end) {
-        return std::chrono::duration<double>(end - start).count();
+    void Start(size_t group_count, const std::string& log_path) {
+        histories_.resize(group_count);
+        if (log_path.empty()) {
+            return;
+        }
+        log_ = std::fopen(log_path.c_str(), "w");
+        if (log_ == nullptr) {
+            errors::Exit("Telemetry", "open " + log_path + ": " + std::strerror(errno));
+        }
+        std::fprintf(log_, "time_s,group,limit_pct,budget_pct,usage_pct,stopped_s,members\n");
     }
 
-    double CountCpuDiff(int64_t last_ticks, int64_t current_ticks) {
-        return static_cast<double>(current_ticks - last_ticks) / consts::kTicksPerSec;
+    void Add(size_t group, double period_secs, const Record& record) {
+        History& history = histories_[group];
+        if (history.records.size() < consts::kTelemetryRecords) {
+            history.records.push_back(record);
+        } else {
+            history.records[history.next] = record;
+        }
+        history.next = (history.next + 1) % consts::kTelemetryRecords;
+        // Weighted by time, so long idle ticks count for what they cover.
+        double ratio = record.limit > 0 ? record.usage / record.limit : 0.0;
+        auto bucket = static_cast<int>(ratio * consts::kHundredPercent);
+        history.usage_ns[std::clamp(bucket, 0, consts::kUsageBuckets)] +=
+            static_cast<int64_t>(period_secs * consts::kNsecPerSec);
+        history.limit_secs += record.limit * period_secs;
+        history.usage_secs += record.usage * period_secs;
+        history.stopped_secs += record.stopped_secs;
+        history.total_secs += period_secs;
+        if (log_ != nullptr) {
+            std::fprintf(log_, "%.3f,%zu,%.2f,%.2f,%.2f,%.4f,%zu\n", record.time_secs, group,
+                         record.limit * consts::kHundredPercent,
+                         record.budget * consts::kHundredPercent,
+                         record.usage * consts::kHundredPercent, record.stopped_secs,
+                         record.members);
+        }
     }
 
-    double CountSleepTime(double cpu_diff, double elapsed_diff, double limit_fraction) {
-        return (cpu_diff / limit_fraction) - elapsed_diff;
+    // The group's last `count` periods, oldest first, one line each.
+    std::string Recent(size_t group, size_t count) const {
+        const History& history = histories_.at(group);
+        size_t size = history.records.size();
+        count = std::min(count, size);
+        std::ostringstream lines;
+        for (size_t i = size - count; i < size; ++i) {
+            const Record& record = history.records[(history.next + i) % size];
+            lines << "t=" << record.time_secs
+                  << " limit=" << record.limit * consts::kHundredPercent
+                  << " budget=" << record.budget * consts::kHundredPercent
+                  << " usage=" << record.usage * consts::kHundredPercent
+                  << " stopped=" << record.stopped_secs << " members=" << record.members << "\n";
+        }
+        return lines.str();
     }
 
-    void RunCpuLimitByPid(const CommandInfo& cmd) {
-        int64_t last_ticks = GetProcessCpuUsage(cmd.pid);
-        auto last_time = std::chrono::steady_clock::now();
-        all_pids.push_back(cmd.pid);
-        while (true) {
-            kill(cmd.pid, SIGCONT);
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    // Usage as a percentage of the limit, by the share of time spent at or
+    // below it; the last bucket collects everything over kUsageBuckets%.
+    void PrintSummary() const {
+        for (size_t i = 0; i < histories_.size(); ++i) {
+            const History& history = histories_[i];
+            if (history.total_secs <= 0) {
+                continue;
+            }
+            std::fprintf(stderr,
+                         "group %zu: %.1fs, usage %.1f%% of limit %.1f%%, stopped %.1fs; "
+                         "usage/limit p50 %d%% p95 %d%% p99 %d%% max %d%%\n",
+                         i, history.total_secs,
+                         history.usage_secs / history.total_secs * consts::kHundredPercent,
+                         history.limit_secs / history.total_secs * consts::kHundredPercent,
+                         history.stopped_secs, Percentile(history, 0.5),
+                         Percentile(history, 0.95), Percentile(history, 0.99),
+                         Percentile(history, 1.0));
+        }
+    }
+
+private:
+    struct History {
+        std::vector<Record> records;
+        size_t next = 0;
+        int64_t usage_ns[consts::kUsageBuckets + 1] = {};
+        double limit_secs = 0.0;
+        double usage_secs = 0.0;
+        double stopped_secs = 0.0;
+        double total_secs = 0.0;
+    };
+
+    static int Percentile(const History& history, double fraction) {
+        auto total_ns = static_cast<int64_t>(history.total_secs * consts::kNsecPerSec);
+        auto rank = static_cast<int64_t>(fraction * static_cast<double>(total_ns));
+        int64_t seen = 0;
+        int last = 0;
+        for (int bucket = 0; bucket <= consts::kUsageBuckets; ++bucket) {
+            if (history.usage_ns[bucket] == 0) {
+                continue;
+            }
+            seen += history.usage_ns[bucket];
+            last = bucket;
+            if (seen >= rank) {
+                break;
+            }
+        }
+        return last;
+    }
+
+    std::vector<History> histories_;
+    FILE* log_ = nullptr;
+};
+
+EventLoop event_loop;
+std::vector<std::unique_ptr<TargetGroup>> groups;
+std::unique_ptr<ControlServer> control_server;
+pid_t launched_pid = 0;
+CgroupThrottle cgroup_throttle;
+Telemetry telemetry;
+
+class CpuLimit {
+public:
+    CpuLimit(int argc, char** argv) {
+        fd_limit_ = RaiseFdLimit();
+        std::atexit(CleanUp);
+        signal(SIGINT, SignalHandler);
+        signal(SIGTERM, SignalHandler);
+
+        CommandInfo cmd = ReadArgc(argc, argv);
+        if (!cmd.command.empty()) {
+            RunLaunch(cmd);
+        }
+        if (!cmd.config_path.empty()) {
+            RunGroups(cmd, LoadConfig(cmd));
+            return;
+        }
+        if (cmd.backend == Backend::kCgroup &&
+            cgroup_throttle.Setup(cmd.limit_fraction, cmd.cgroup_parent)) {
+            if (cmd.pid != 0) {
+                RunCgroupByPid(cmd);
+            } else {
+                RunCgroupByExec(cmd);
+            }
+        }
+        GroupSpec spec;
+        spec.kind = cmd.pid != 0 ? GroupSpec::Kind::kPid : GroupSpec::Kind::kExec;
+        spec.target = cmd.pid != 0 ? std::to_string(cmd.pid) : cmd.exec_filename;
+        spec.limit_fraction = cmd.limit_fraction;
+        spec.fair = cmd.fair;
+        spec.weights = cmd.weights;
+        RunGroups(cmd, {spec});
+    }
 
-            int64_t current_ticks = GetProcessCpuUsage(cmd.pid);
-            auto current_time = std::chrono::steady_clock::now();
-            double elapsed_diff = CountElapsedTime(last_time, current_time);
-            double cpu_diff = CountCpuDiff(last_ticks, current_ticks);
+private:
+    // Everything cpulimit says goes to stderr: in launch mode stdout belongs to
+    // the command.
+    static void CleanUp() {
+        cgroup_throttle.Release();
+        for (const auto& group : groups) {
+            group->Signal(SIGCONT);
+        }
+        telemetry.PrintSummary();
+        std::fprintf(stderr, "\nCpulimit Exit\n");
+    }
 
-            if (cpu_diff >= elapsed_diff * cmd.limit_fraction) {
-                kill(cmd.pid, SIGSTOP);
+    // In launch mode the command decides how to react, and its exit ends
+    // cpulimit; it is continued so that it can handle the signal at all.
+    static void SignalHandler(int signal_num) {
+        if (launched_pid != 0) {
+            kill(launched_pid, signal_num);
+            kill(launched_pid, SIGCONT);
+            return;
+        }
+        std::exit(signal_num);
+    }
 
-                double sleep_time = CountSleepTime(cpu_diff, elapsed_diff, cmd.limit_fraction);
+    void ExitWithUsage() {
+        std::fprintf(stderr,
+                     "Usage:\n"
+                     "  cpulimit -p <pid> -l <limit_percentage> [options]\n"
+                     "  cpulimit -e <executable_name> -l <limit_percentage> [options]\n"
+                     "  cpulimit --config=<file> [--period=<ms>]\n"
+                     "  cpulimit -l <limit_percentage> [options] -- <command> [args...]\n"
+                     "Options:\n"
+                     "  --backend=signal|cgroup\n"
+                     "  --cgroup-parent=<path>  delegated cgroup to create the cgroup backend's\n"
+                     "                          leaf in, instead of the target's own cgroup\n"
+                     "  --period=<ms>  control period for the signal backend, 10..1000\n"
+                     "  --fair  split a group's limit between its members by weight\n"
+                     "  --weight=<pid>:<weight>  member weight for --fair, default 1\n"
+                     "  --control=<path>  unix socket for status and runtime changes\n"
+                     "  --telemetry=<file>  write one CSV line per group and period\n");
+        _exit(EXIT_FAILURE);
+    }
+
+    enum class Backend { kSignal, kCgroup };
+
+    struct CommandInfo {
+        int pid = 0;
+        std::string exec_filename;
+        double limit_fraction = 0.0;
+        Backend backend = Backend::kSignal;
+        std::chrono::nanoseconds period = consts::kDefaultPeriod;
+        std::string config_path;
+        bool fair = false;
+        std::map<int, double> weights;
+        std::vector<char*> command;
+        std::string control_path;
+        std::string telemetry_path;
+        std::string cgroup_parent;
+    };
+
+    CommandInfo ReadArgc(int argc, char** argv) {
+        CommandInfo cmd;
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool has_value = i + 1 < argc;
+            if (arg == "--") {
+                cmd.command.assign(argv + i + 1, argv + argc);
+                if (cmd.command.empty()) {
+                    ExitWithUsage();
+                }
+                cmd.command.push_back(nullptr);
+                break;
+            }
+            if (arg == "-p" && has_value) {
+                cmd.pid = std::atoi(argv[++i]);
+                if (cmd.pid <= 0) {
+                    ExitWithUsage();
+                }
+            } else if (arg == "-e" && has_value) {
+                cmd.exec_filename = argv[++i];
+            } else if (arg == "-l" && has_value) {
+                cmd.limit_fraction = std::atoi(argv[++i]) / consts::kHundredPercent;
+            } else if (arg == "--backend=signal") {
+                cmd.backend = Backend::kSignal;
+            } else if (arg == "--backend=cgroup") {
+                cmd.backend = Backend::kCgroup;
+            } else if (arg.rfind("--cgroup-parent=", 0) == 0) {
+                cmd.cgroup_parent = arg.substr(16);
+            } else if (arg == "--fair") {
+                cmd.fair = true;
+            } else if (arg.rfind("--weight=", 0) == 0) {
+                int pid = 0;
+                double weight = 0;
+                if (sscanf(arg.c_str() + 9, "%d:%lf", &pid, &weight) != 2 || pid <= 0 ||
+                    weight <= 0) {
+                    ExitWithUsage();
+                }
+                cmd.weights[pid] = weight;
+                cmd.fair = true;
+            } else if (arg.rfind("--control=", 0) == 0) {
+                cmd.control_path = arg.substr(10);
+            } else if (arg.rfind("--telemetry=", 0) == 0) {
+                cmd.telemetry_path = arg.substr(12);
+            } else if (arg.rfind("--config=", 0) == 0) {
+                cmd.config_path = arg.substr(9);
+            } else if (arg.rfind("--period=", 0) == 0) {
+                cmd.period = std::chrono::milliseconds(std::atoi(arg.c_str() + 9));
+                if (cmd.period < consts::kMinPeriod || cmd.period > consts::kMaxPeriod) {
+                    ExitWithUsage();
+                }
+            } else {
+                ExitWithUsage();
+            }
+        }
+        // The kernel enforces the cgroup backend's limit on the group as a whole,
+        // so nothing per member or per period exists to weigh, report or change.
+        if (cmd.backend == Backend::kCgroup &&
+            (cmd.fair || !cmd.control_path.empty() || !cmd.telemetry_path.empty())) {
+            errors::Exit("ReadArgc", "--backend=cgroup cannot be combined with --fair, --weight, "
+                                     "--control or --telemetry");
+        }
+        if (!cmd.cgroup_parent.empty() && cmd.backend != Backend::kCgroup) {
+            errors::Exit("ReadArgc", "--cgroup-parent requires --backend=cgroup");
+        }
+        if (!cmd.config_path.empty()) {
+            if (cmd.pid != 0 || !cmd.exec_filename.empty() || cmd.backend != Backend::kSignal ||
+                !cmd.command.empty()) {
+                ExitWithUsage();
+            }
+            return cmd;
+        }
+        if (!cmd.command.empty()) {
+            if (cmd.limit_fraction <= 0 || cmd.pid != 0 || !cmd.exec_filename.empty()) {
+                ExitWithUsage();
+            }
+            return cmd;
+        }
+        if (cmd.limit_fraction <= 0 || (cmd.pid != 0) == !cmd.exec_filename.empty()) {
+            ExitWithUsage();
+        }
+        return cmd;
+    }
 
-                if (sleep_time > 0) {
-                    std::this_thread::sleep_for(std::chrono::duration<double>(sleep_time));
+    // One group per line: "pid <pid> <limit>", "exe <name> <limit>" or
+    // "cgroup <path> <limit>", limits in percent, optionally followed by "fair";
+    // '#' starts a comment. --fair and --weight apply to every group.
+    std::vector<GroupSpec> LoadConfig(const CommandInfo& cmd) {
+        const std::string& path = cmd.config_path;
+        std::ifstream file(path);
+        if (!file.is_open()) {
+            errors::Exit("LoadConfig", "open " + path);
+        }
+        std::vector<GroupSpec> specs;
+        std::string line;
+        for (int line_number = 1; std::getline(file, line); ++line_number) {
+            std::istringstream fields(line.substr(0, line.find('#')));
+            std::string kind;
+            if (!(fields >> kind)) {
+                continue;
+            }
+            GroupSpec spec;
+            spec.fair = cmd.fair;
+            spec.weights = cmd.weights;
+            double limit = 0;
+            std::string option;
+            std::string where = path + ":" + std::to_string(line_number);
+            if (!(fields >> spec.target >> limit) || limit <= 0) {
+                errors::Exit("LoadConfig", where + ": malformed");
+            }
+            while (fields >> option) {
+                if (option != "fair") {
+                    errors::Exit("LoadConfig", where + ": unknown option " + option);
                 }
+                spec.fair = true;
             }
+            spec.limit_fraction = limit / consts::kHundredPercent;
+            if (kind == "pid" && std::atoi(spec.target.c_str()) > 0) {
+                spec.kind = GroupSpec::Kind::kPid;
+            } else if (kind == "exe") {
+                spec.kind = GroupSpec::Kind::kExec;
+                spec.persistent = true;
+            } else if (kind == "cgroup") {
+                spec.kind = GroupSpec::Kind::kCgroup;
+                spec.persistent = true;
+            } else {
+                errors::Exit("LoadConfig", where + ": unknown group kind " + kind);
+            }
+            specs.push_back(spec);
+        }
+        if (specs.empty()) {
+            errors::Exit("LoadConfig", "no groups in " + path);
+        }
+        return specs;
+    }
 
-            last_ticks = current_ticks;
-            last_time = std::chrono::steady_clock::now();
+    void RunCgroupByPid(const CommandInfo& cmd) {
+        if (!cgroup_throttle.Attach(cmd.pid)) {
+            errors::Report("RunCgroupByPid", "cannot move target into the cgroup, falling back to "
+                                             "signals");
+            cgroup_throttle.Release();
+            return;
         }
+        GroupSpec spec;
+        spec.target = std::to_string(cmd.pid);
+        groups.push_back(std::make_unique<TargetGroup>(spec, event_loop));
+        TargetGroup& group = *groups.back();
+        if (group.Add(cmd.pid)) {
+            event_loop.WaitUntil(std::chrono::steady_clock::time_point::max(),
+                                 [&group] { return group.Empty(); });
+        }
+        std::exit(EXIT_SUCCESS);
     }
 
-    void RunCpuLimitByExec(const CommandInfo& cmd) {
-        all_pids = GetPidsByExec(cmd.exec_filename);
-        if (all_pids.empty()) {
-            errors::Exit("RunCpuLimitByExec", "no processes found with the given executable name");
+    // Children forked after a target is attached are born inside the cgroup;
+    // the tree picks up matches and descendants that predate it. Like -e with
+    // signals, this ends with an error if nothing matches at first, and once
+    // every attached process has exited. If none of the first matches can be
+    // attached, it returns to fall back to signals.
+    void RunCgroupByExec(const CommandInfo& cmd) {
+        ProcessTree tree({cmd.exec_filename});
+        GroupSpec spec;
+        spec.kind = GroupSpec::Kind::kExec;
+        spec.target = cmd.exec_filename;
+        groups.push_back(std::make_unique<TargetGroup>(spec, event_loop));
+        TargetGroup& group = *groups.back();
+        for (bool first = true;; first = false) {
+            bool matched = false;
+            for (auto [pid, index] : tree.Update()) {
+                matched = true;
+                if (cgroup_throttle.Attach(pid)) {
+                    group.Add(pid);
+                }
+            }
+            if (!group.Empty()) {
+                event_loop.WaitUntil(std::chrono::steady_clock::now() + consts::kCgroupPollInterval,
+                                     [&group] { return group.Empty(); });
+                continue;
+            }
+            if (!first) {
+                std::exit(EXIT_SUCCESS);
+            }
+            if (!matched) {
+                errors::Exit("RunCgroupByExec", "no processes found to limit");
+            }
+            errors::Report("RunCgroupByExec", "cannot move any target into the cgroup, falling "
+                                              "back to signals");
+            cgroup_throttle.Release();
+            groups.clear();
+            return;
         }
-        int64_t last_ticks = GetTotalCpuUsage(all_pids);
-        auto last_time = std::chrono::steady_clock::now();
+    }
 
-        while (true) {
-            for (int pid : all_pids) {
-                kill(pid, SIGCONT);
+    // The command is forked but held on a pipe until it is under the limiter,
+    // so it is limited from its first instruction. cpulimit exits the moment the
+    // command does (its pidfd is in the event loop) and passes on its exit
+    // status, or dies from the same signal.
+    [[noreturn]] void RunLaunch(const CommandInfo& cmd) {
+        int sync[2];
+        if (pipe2(sync, O_CLOEXEC) != 0) {
+            errors::Exit("RunLaunch", std::string("pipe2: ") + std::strerror(errno));
+        }
+        pid_t pid = fork();
+        if (pid < 0) {
+            errors::Exit("RunLaunch", std::string("fork: ") + std::strerror(errno));
+        }
+        if (pid == 0) {
+            close(sync[1]);
+            char go;
+            if (read(sync[0], &go, 1) != 1) {
+                _exit(127);
+            }
+            setrlimit(RLIMIT_NOFILE, &fd_limit_);
+            execvp(cmd.command[0], cmd.command.data());
+            std::perror(cmd.command[0]);
+            _exit(127);
+        }
+        close(sync[0]);
+        launched_pid = pid;
+        signal(SIGHUP, SignalHandler);
+        signal(SIGQUIT, SignalHandler);
+        int pidfd = static_cast<int>(syscall(SYS_pidfd_open, pid, 0));
+        if (pidfd < 0) {
+            errors::Exit("RunLaunch", std::string("pidfd_open: ") + std::strerror(errno));
+        }
+        event_loop.Watch(pidfd, [this] { launched_exited_ = true; });
+
+        bool in_cgroup = false;
+        if (cmd.backend == Backend::kCgroup &&
+            cgroup_throttle.Setup(cmd.limit_fraction, cmd.cgroup_parent)) {
+            in_cgroup = cgroup_throttle.Attach(pid);
+            if (!in_cgroup) {
+                errors::Report("RunLaunch", "cannot move the command into the cgroup, falling "
+                                            "back to signals");
+                cgroup_throttle.Release();
+            }
+        }
+        GroupSpec spec;
+        spec.target = std::to_string(pid);
+        spec.limit_fraction = cmd.limit_fraction;
+        spec.fair = cmd.fair;
+        spec.weights = cmd.weights;
+        spec.include_children = true;
+        if (in_cgroup) {
+            groups.push_back(std::make_unique<TargetGroup>(spec, event_loop));
+            groups.back()->Add(pid);
+        }
+        if (write(sync[1], "x", 1) != 1) {
+            errors::Exit("RunLaunch", std::string("write: ") + std::strerror(errno));
+        }
+        close(sync[1]);
+
+        if (in_cgroup) {
+            event_loop.WaitUntil(std::chrono::steady_clock::time_point::max(),
+                                 [this] { return launched_exited_; });
+        } else {
+            RunGroups(cmd, {spec});
+        }
+        siginfo_t info = {};
+        waitid(P_PID, pid, &info, WEXITED);
+        launched_pid = 0;
+        if (info.si_code == CLD_EXITED) {
+            std::exit(info.si_status);
+        }
+        CleanUp();
+        std::fflush(stdout);
+        signal(info.si_status, SIG_DFL);
+        raise(info.si_status);
+        _exit(EXIT_FAILURE);
+    }
+
+    // Every group runs on the same period grid; within a period each member
+    // runs for its group's duty at its own phase (see PlanPeriod). All edges are
+    // absolute deadlines, so scheduling jitter does not drift. Runs until every
+    // non-persistent group has lost all of its members, or a launched command
+    // has exited.
+    //
+    // While no member is being stopped and every group stays well under its
+    // limit, the tick doubles up to kMaxIdleInterval, so idle targets cost a
+    // sample and a /proc scan per second. Any busier tick, new member or
+    // control command drops straight back to the configured period. A target
+    // that wakes up right after a long tick thus runs unthrottled for at most
+    // kMaxIdleInterval, and the controller repays that over its window.
+    void RunGroups(const CommandInfo& cmd, const std::vector<GroupSpec>& specs) {
+        std::vector<std::string> names(specs.size());
+        bool track_tree = false;
+        for (size_t i = 0; i < specs.size(); ++i) {
+            groups.push_back(std::make_unique<TargetGroup>(specs[i], event_loop));
+            if (specs[i].kind == GroupSpec::Kind::kPid &&
+                !groups.back()->Add(std::atoi(specs[i].target.c_str()))) {
+                errors::Report("RunGroups", "no process with pid " + specs[i].target);
+            }
+            if (specs[i].kind == GroupSpec::Kind::kExec) {
+                names[i] = specs[i].target;
+                track_tree = true;
+            }
+            track_tree = track_tree || specs[i].include_children;
+        }
+        ProcessTree tree(names);
+        for (size_t i = 0; i < specs.size(); ++i) {
+            if (specs[i].include_children) {
+                tree.Adopt(std::atoi(specs[i].target.c_str()), static_cast<int>(i));
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        ProcessTree* shared_tree = track_tree ? &tree : nullptr;
+        tree_ = shared_tree;
+        SyncMembers(shared_tree);
+        if (!cmd.control_path.empty()) {
+            control_server = std::make_unique<ControlServer>(
+                cmd.control_path, event_loop,
+                [this](const std::string& line) { return HandleControl(line); });
+        }
+        auto all_finished = [this] {
+            return launched_exited_ ||
+                   std::all_of(groups.begin(), groups.end(),
+                               [](const auto& group) { return group->Finished(); });
+        };
+        if (all_finished()) {
+            errors::Exit("RunGroups", "no processes found to limit");
+        }
 
-            int64_t current_ticks = GetTotalCpuUsage(all_pids);
-            auto current_time = std::chrono::steady_clock::now();
-            double elapsed_diff = CountElapsedTime(last_time, current_time);
-            double cpu_diff = CountCpuDiff(last_ticks, current_ticks);
+        auto max_interval =
+            std::max<std::chrono::nanoseconds>(cmd.period, consts::kMaxIdleInterval);
+        std::chrono::nanoseconds interval = cmd.period;
+        // What each group was planned to get this period, for the controller
+        // and the telemetry once the period is over.
+        struct Plan {
+            double duty;
+            double budget;
+            std::chrono::nanoseconds stopped;
+        };
+        std::vector<Plan> plans(groups.size());
+        std::vector<SignalEdge> edges;
+        telemetry.Start(groups.size(), cmd.telemetry_path);
+        auto run_start = std::chrono::steady_clock::now();
+        auto period_start = run_start;
+        while (!all_finished()) {
+            edges.clear();
+            bool throttled = false;
+            for (size_t i = 0; i < groups.size(); ++i) {
+                DutyController& controller = groups[i]->Controller();
+                throttled = groups[i]->PlanPeriod(cmd.period, edges) || throttled;
+                plans[i] = {controller.Duty(), controller.Budget(),
+                            groups[i]->StoppedTime(cmd.period)};
+            }
+            if (throttled) {
+                interval = cmd.period;
+            }
+            std::stable_sort(edges.begin(), edges.end(), [](const auto& lhs, const auto& rhs) {
+                return lhs.offset < rhs.offset;
+            });
+            for (const SignalEdge& edge : edges) {
+                event_loop.WaitUntil(period_start + edge.offset, all_finished);
+                edge.group->SignalMember(edge.pid, edge.signal_num);
+            }
+            // Nothing is stopped during a long tick, so a control command may
+            // end it early.
+            bool backed_off = interval > cmd.period;
+            event_loop.WaitUntil(period_start + interval,
+                                 [&] { return all_finished() || (backed_off && woken_); });
 
-            if (cpu_diff >= elapsed_diff * cmd.limit_fraction) {
-                for (int pid : all_pids) {
-                    kill(pid, SIGSTOP);
+            // After an overrun (e.g. cpulimit itself was descheduled) the grid is
+            // restarted instead of replaying the missed periods back to back.
+            auto now = std::chrono::steady_clock::now();
+            auto tick = interval;
+            if (backed_off && woken_) {
+                tick = now - period_start;
+                period_start = now;
+            } else {
+                period_start += interval;
+                if (now - period_start > cmd.period) {
+                    period_start = now;
                 }
+            }
 
-                double sleep_time = CountSleepTime(cpu_diff, elapsed_diff, cmd.limit_fraction);
+            double tick_secs = std::chrono::duration<double>(tick).count();
+            double elapsed_secs = std::chrono::duration<double>(period_start - run_start).count();
+            bool idle = !throttled;
+            for (size_t i = 0; i < groups.size(); ++i) {
+                TargetGroup& group = *groups[i];
+                double cpu_secs =
+                    static_cast<double>(group.TakeRuntimeDiff()) / consts::kNsecPerSec;
+                // A long tick is only taken while nothing is stopped.
+                double stopped_secs =
+                    tick > cmd.period ? 0.0
+                                      : std::chrono::duration<double>(plans[i].stopped).count();
+                telemetry.Add(i, tick_secs,
+                              {elapsed_secs, group.Spec().limit_fraction, plans[i].budget,
+                               cpu_secs / tick_secs, stopped_secs, group.Size()});
+                group.Controller().Update(cpu_secs, plans[i].duty * tick_secs, tick_secs);
+                idle = idle && cpu_secs <= consts::kIdleUsageRatio *
+                                               group.Spec().limit_fraction * tick_secs;
+            }
+            bool joined = SyncMembers(shared_tree);
+            idle = idle && !joined && !woken_;
+            interval = idle ? std::min(interval * 2, max_interval) : cmd.period;
+            woken_ = false;
+        }
+    }
 
-                if (sleep_time > 0) {
-                    std::this_thread::sleep_for(std::chrono::duration<double>(sleep_time));
+    // Commands, with groups numbered as in the config (0 for -p/-e/launch):
+    //   status                    one line per group, usage and limit in percent
+    //   limit <group> <percent>   new limit, applied from the next period
+    //   add <group> <pid>         start limiting pid as part of the group
+    //   remove <group> <pid>      stop limiting pid; it is left running
+    //   history <group> <count>   the group's last periods, oldest first
+    std::string HandleControl(const std::string& line) {
+        std::istringstream fields(line);
+        std::string command;
+        fields >> command;
+        if (command == "status") {
+            std::ostringstream reply;
+            for (size_t i = 0; i < groups.size(); ++i) {
+                DutyController& controller = groups[i]->Controller();
+                const GroupSpec& spec = groups[i]->Spec();
+                reply << "group " << i << " target=" << spec.target
+                      << " limit=" << spec.limit_fraction * consts::kHundredPercent
+                      << " usage=" << controller.Usage() * consts::kHundredPercent
+                      << " duty=" << controller.Duty() << " members=";
+                std::vector<int> pids = groups[i]->Pids();
+                for (size_t j = 0; j < pids.size(); ++j) {
+                    reply << (j == 0 ? "" : ",") << pids[j];
                 }
+                reply << "\n";
             }
+            return reply.str() + "ok\n";
+        }
 
-            all_pids = GetPidsByExec(cmd.exec_filename);
+        if (command != "limit" && command != "add" && command != "remove" &&
+            command != "history") {
+            return "error unknown command " + command + "\n";
+        }
+        size_t index = 0;
+        std::string argument;
+        std::string extra;
+        if (!(fields >> index >> argument) || (fields >> extra)) {
+            return "error usage: status | limit|add|remove|history <group> <value>\n";
+        }
+        if (index >= groups.size()) {
+            return "error no group " + std::to_string(index) + "\n";
+        }
+        // A limit may be fractional; a pid or a count is a whole number, and
+        // "12.7" is refused rather than taken for 12.
+        double limit = 0;
+        int number = 0;
+        const char* end = argument.data() + argument.size();
+        bool valid = command == "limit"
+                         ? std::from_chars(argument.data(), end, limit).ptr == end && limit > 0
+                         : std::from_chars(argument.data(), end, number).ptr == end && number > 0;
+        if (!valid) {
+            return "error bad value " + argument + "\n";
+        }
+        if (command == "history") {
+            return telemetry.Recent(index, static_cast<size_t>(number)) + "ok\n";
+        }
+        TargetGroup& group = *groups[index];
+        woken_ = true;
+        if (command == "limit") {
+            group.SetLimit(limit / consts::kHundredPercent);
+        } else if (command == "add") {
+            if (!group.Add(number)) {
+                return "error no process " + std::to_string(number) + "\n";
+            }
+            // Descendants of an added process are limited along with it in
+            // the groups that follow descendants at all.
+            const GroupSpec& spec = group.Spec();
+            if (tree_ != nullptr &&
+                (spec.kind == GroupSpec::Kind::kExec || spec.include_children)) {
+                tree_->Adopt(number, static_cast<int>(index));
+            }
+        } else {
+            group.SignalMember(number, SIGCONT);
+            group.Remove(number);
+            // Otherwise its children would keep joining the group.
+            if (tree_ != nullptr) {
+                tree_->Forget(number);
+            }
+        }
+        return "ok\n";
+    }
 
-            last_ticks = current_ticks;
-            last_time = std::chrono::steady_clock::now();
+    // The one membership pass of a tick, shared by all groups: a single tree
+    // update covers every name-based group, and each cgroup group reads only
+    // its own member list. Returns whether any group gained a member.
+    bool SyncMembers(ProcessTree* tree) {
+        bool joined = false;
+        if (tree != nullptr) {
+            for (auto [pid, index] : tree->Update()) {
+                joined = groups[index]->Add(pid) || joined;
+            }
+        }
+        for (const auto& group : groups) {
+            if (group->Spec().kind == GroupSpec::Kind::kCgroup) {
+                joined = group->SyncCgroup() || joined;
+            }
         }
+        return joined;
     }
+
+    // The tree of RunGroups, for control commands; null without name-based or
+    // descendant-following groups.
+    ProcessTree* tree_ = nullptr;
+    // As found at startup, for the launched command.
+    rlimit fd_limit_{};
+    bool launched_exited_ = false;
+    // Set by control commands that change a group, to cut a long idle tick short.
+    bool woken_ = false;
 };
 
 int main(int argc, char** argv) {
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "errors.h"
+
+namespace consts {
+const int64_t kCgroupPeriodUsec = 100000;
+const int64_t kCgroupMinQuotaUsec = 1000;
+}  // namespace consts
+
+// Throttles through cgroup v2 cpu.max, so the kernel enforces the limit and
+// cpulimit itself only has to attach new targets. Targets are moved into one
+// leaf cgroup, created under the cgroup the first of them is in, so that
+// whatever limits that cgroup has (a container's, say) still apply on top; a
+// delegated parent can be given instead. On exit the targets are moved back
+// to where they came from and everything cpulimit changed is undone.
+//
+// The parent needs the cpu controller in its subtree_control, which the
+// kernel only allows for the root or a cgroup with no processes of its own:
+// a target sitting in an ordinary leaf cannot be attached without a
+// delegated parent, and its caller falls back to signals.
+class CgroupThrottle {
+public:
+    // `mount` is the cgroup2 hierarchy, looked up in mountinfo when empty;
+    // cgroup paths of processes are read under `proc_root`.
+    explicit CgroupThrottle(std::string mount = "", std::string proc_root = "/proc")
+        : mount_(std::move(mount)), proc_root_(std::move(proc_root)) {
+    }
+
+    // The cpu.max line for a limit in CPUs.
+    static std::string CpuMax(double limit_fraction) {
+        auto quota = static_cast<int64_t>(std::llround(limit_fraction * consts::kCgroupPeriodUsec));
+        quota = std::max(consts::kCgroupMinQuotaUsec, quota);
+        return std::to_string(quota) + " " + std::to_string(consts::kCgroupPeriodUsec);
+    }
+
+    // `parent`, a cgroup path like those in /proc/<pid>/cgroup, overrides
+    // where the leaf is created.
+    bool Setup(double limit_fraction, const std::string& parent = "") {
+        errno = 0;
+        if (mount_.empty()) {
+            mount_ = FindCgroup2Mount();
+        }
+        if (mount_.empty()) {
+            return Fail("no cgroup2 mount");
+        }
+        std::string controllers;
+        if (!ReadLine(mount_ + "/cgroup.controllers", controllers) || !HasCpu(controllers)) {
+            return Fail("cpu controller is not available in cgroup v2");
+        }
+        cpu_max_ = CpuMax(limit_fraction);
+        parent_ = parent;
+        if (!parent_.empty() && parent_.front() != '/') {
+            parent_.insert(0, "/");
+        }
+        while (!parent_.empty() && parent_.back() == '/') {
+            parent_.pop_back();
+        }
+        delegated_ = !parent.empty();
+        return true;
+    }
+
+    // Moves pid into the leaf, creating the leaf on first use. Anything forked
+    // inside the leaf is already there.
+    bool Attach(int pid) {
+        std::string origin;
+        if (!ReadOrigin(pid, origin)) {
+            return Refuse(pid, "no cgroup v2 membership");
+        }
+        if (!leaf_.empty() && mount_ + origin == leaf_) {
+            return true;
+        }
+        if (leaf_.empty() && !CreateLeaf(delegated_ ? parent_ : origin)) {
+            return false;
+        }
+        if (!delegated_ && origin != leaf_parent_) {
+            return Refuse(pid, "in " + Name(origin) + ", not in " + Name(leaf_parent_));
+        }
+        if (!WriteLine(leaf_ + "/cgroup.procs", std::to_string(pid))) {
+            return Refuse(pid, "write cgroup.procs" + Cause());
+        }
+        origins_[pid] = origin;
+        return true;
+    }
+
+    // Anything forked inside the leaf is moved out along with the targets, since
+    // a cgroup can only be removed once it is empty.
+    void Release() {
+        if (leaf_.empty()) {
+            return;
+        }
+        std::string fallback = origins_.empty() ? leaf_parent_ : origins_.begin()->second;
+        for (const auto& [pid, origin] : origins_) {
+            WriteLine(mount_ + origin + "/cgroup.procs", std::to_string(pid));
+        }
+        {
+            std::ifstream procs(leaf_ + "/cgroup.procs");
+            int pid;
+            while (procs >> pid) {
+                WriteLine(mount_ + fallback + "/cgroup.procs", std::to_string(pid));
+            }
+        }
+        if (rmdir(leaf_.c_str()) != 0) {
+            errors::Report("CgroupThrottle", "rmdir " + leaf_ + Cause());
+        } else if (enabled_cpu_ &&
+                   !WriteLine(mount_ + leaf_parent_ + "/cgroup.subtree_control", "-cpu")) {
+            errors::Report("CgroupThrottle",
+                           "disable cpu controller in " + Name(leaf_parent_) + Cause());
+        }
+        leaf_.clear();
+        leaf_parent_.clear();
+        enabled_cpu_ = false;
+        origins_.clear();
+    }
+
+private:
+    static std::string FindCgroup2Mount() {
+        std::ifstream mountinfo("/proc/self/mountinfo");
+        std::string line;
+        while (std::getline(mountinfo, line)) {
+            size_t separator = line.find(" - ");
+            if (separator == std::string::npos ||
+                line.compare(separator + 3, 8, "cgroup2 ") != 0) {
+                continue;
+            }
+            std::istringstream fields(line);
+            std::string skip;
+            std::string mount_point;
+            fields >> skip >> skip >> skip >> skip >> mount_point;
+            return mount_point;
+        }
+        return "";
+    }
+
+    static bool HasCpu(const std::string& controllers) {
+        return (" " + controllers + " ").find(" cpu ") != std::string::npos;
+    }
+
+    static bool ReadLine(const std::string& path, std::string& line) {
+        std::ifstream file(path);
+        return static_cast<bool>(std::getline(file, line));
+    }
+
+    static bool WriteLine(const std::string& path, const std::string& line) {
+        std::ofstream file(path);
+        file << line << std::flush;
+        return static_cast<bool>(file);
+    }
+
+    static std::string Cause() {
+        return errno != 0 ? std::string(": ") + std::strerror(errno) : "";
+    }
+
+    // Cgroup paths are kept relative to the mount and without a trailing
+    // slash, so that the root is "".
+    static std::string Name(const std::string& cgroup) {
+        return cgroup.empty() ? "/" : cgroup;
+    }
+
+    bool ReadOrigin(int pid, std::string& origin) const {
+        std::ifstream file(proc_root_ + "/" + std::to_string(pid) + "/cgroup");
+        std::string line;
+        while (std::getline(file, line)) {
+            if (line.rfind("0::/", 0) == 0) {
+                origin = line.size() == 4 ? "" : line.substr(3);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool CreateLeaf(const std::string& parent) {
+        errno = 0;
+        std::string path = mount_ + parent;
+        std::string controllers;
+        if (!ReadLine(path + "/cgroup.controllers", controllers) || !HasCpu(controllers)) {
+            errors::Report("CgroupThrottle", "cpu controller is not available in " + Name(parent));
+            return false;
+        }
+        std::string subtree;
+        ReadLine(path + "/cgroup.subtree_control", subtree);
+        bool enable = !HasCpu(subtree);
+        if (enable && !WriteLine(path + "/cgroup.subtree_control", "+cpu")) {
+            errors::Report("CgroupThrottle",
+                           "enable cpu controller in " + Name(parent) + Cause());
+            return false;
+        }
+        std::string leaf = path + "/cpulimit." + std::to_string(getpid());
+        bool made = mkdir(leaf.c_str(), 0755) == 0;
+        if (!made || !WriteLine(leaf + "/cpu.max", cpu_max_)) {
+            std::string step = made ? "write cpu.max in " : "mkdir ";
+            errors::Report("CgroupThrottle", step + leaf + Cause());
+            if (made) {
+                rmdir(leaf.c_str());
+            }
+            if (enable) {
+                WriteLine(path + "/cgroup.subtree_control", "-cpu");
+            }
+            return false;
+        }
+        leaf_ = leaf;
+        leaf_parent_ = parent;
+        enabled_cpu_ = enable;
+        return true;
+    }
+
+    bool Refuse(int pid, const std::string& reason) {
+        errors::Report("CgroupThrottle", "cannot attach " + std::to_string(pid) + ": " + reason);
+        return false;
+    }
+
+    bool Fail(const std::string& reason) {
+        errors::Report("CgroupThrottle", reason + Cause() + ", falling back to signals");
+        return false;
+    }
+
+    std::string mount_;
+    std::string proc_root_;
+    std::string cpu_max_;
+    std::string parent_;
+    bool delegated_ = false;
+    std::string leaf_;
+    std::string leaf_parent_;
+    bool enabled_cpu_ = false;
+    std::map<int, std::string> origins_;
+};
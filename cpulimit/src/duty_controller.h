@@ -0,0 +1,108 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+
+namespace consts {
+const double kWindowSecs = 1.0;
+const double kDemandSmoothing = 0.3;
+const double kProportionalGain = 0.5;
+const double kIntegralGain = 0.2;
+const double kMinDemand = 1e-3;
+}  // namespace consts
+
+// Decides how much CPU the group may use in the next period. The budget is
+// the limit plus a PI correction on the error over a sliding window, which
+// absorbs whatever the stop/continue cycle gets wrong. The duty, the fraction
+// of the period the whole group may run, divides the budget by the group's
+// demand: the CPU it burns per second of running, above 1 for multithreaded
+// targets.
+class DutyController {
+public:
+    explicit DutyController(double limit_fraction)
+        : limit_fraction_(limit_fraction),
+          budget_(limit_fraction),
+          duty_(std::min(1.0, limit_fraction)) {
+    }
+
+    double Duty() const {
+        return duty_;
+    }
+
+    // CPU the group may use next period, in CPUs.
+    double Budget() const {
+        return budget_;
+    }
+
+    // Achieved usage over the sliding window, in CPUs.
+    double Usage() const {
+        return window_secs_ > 0 ? window_cpu_secs_ / window_secs_ : 0.0;
+    }
+
+    // Takes effect from the next period. The demand estimate is kept, while
+    // the window and the integral, which only make sense against the old
+    // limit, start over.
+    void SetLimit(double limit_fraction) {
+        limit_fraction_ = limit_fraction;
+        budget_ = limit_fraction;
+        duty_ = std::clamp(budget_ / std::max(demand_, consts::kMinDemand), 0.0, 1.0);
+        integral_ = 0.0;
+        window_.clear();
+        window_cpu_secs_ = 0.0;
+        window_secs_ = 0.0;
+    }
+
+    double Update(double cpu_secs, double run_secs, double period_secs) {
+        if (run_secs > 0) {
+            demand_ += consts::kDemandSmoothing * (cpu_secs / run_secs - demand_);
+        }
+        window_.push_back({cpu_secs, period_secs});
+        window_cpu_secs_ += cpu_secs;
+        window_secs_ += period_secs;
+        // Periods vary in length once idle ticks back off, so the oldest sample
+        // is cut pro rata rather than whole: a long idle tick must not dilute
+        // the fast ticks after it for another full window.
+        while (window_secs_ > consts::kWindowSecs) {
+            Sample& oldest = window_.front();
+            double excess_secs = window_secs_ - consts::kWindowSecs;
+            if (oldest.period_secs <= excess_secs) {
+                window_cpu_secs_ -= oldest.cpu_secs;
+                window_secs_ -= oldest.period_secs;
+                window_.pop_front();
+                continue;
+            }
+            double cut_cpu_secs = oldest.cpu_secs * excess_secs / oldest.period_secs;
+            oldest.cpu_secs -= cut_cpu_secs;
+            oldest.period_secs -= excess_secs;
+            window_cpu_secs_ -= cut_cpu_secs;
+            window_secs_ = consts::kWindowSecs;
+        }
+
+        double error = limit_fraction_ - window_cpu_secs_ / window_secs_;
+        // While the group already runs unthrottled and under the limit there is
+        // nothing to correct; winding the integral up would only let the group
+        // overshoot once it gets busy again.
+        if (duty_ < 1.0 || error < 0) {
+            integral_ = std::clamp(integral_ + consts::kIntegralGain * error, -limit_fraction_,
+                                   limit_fraction_);
+        }
+        budget_ = std::max(0.0, limit_fraction_ + consts::kProportionalGain * error + integral_);
+        duty_ = std::clamp(budget_ / std::max(demand_, consts::kMinDemand), 0.0, 1.0);
+        return duty_;
+    }
+
+private:
+    struct Sample {
+        double cpu_secs;
+        double period_secs;
+    };
+
+    double limit_fraction_;
+    double budget_;
+    double duty_;
+    double demand_ = 1.0;
+    double integral_ = 0.0;
+    std::deque<Sample> window_;
+    double window_cpu_secs_ = 0.0;
+    double window_secs_ = 0.0;
+};
@@ -0,0 +1,17 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+namespace errors {
+inline void Report(const std::string& context, const std::string& message = "") {
+    std::fprintf(stderr, "ERROR %s: %s\n", context.c_str(),
+                 message.empty() ? "unknown error" : message.c_str());
+}
+
+inline void Exit(const std::string& context, const std::string& message = "") {
+    Report(context, message);
+    std::exit(EXIT_FAILURE);
+}
+}  // namespace errors
@@ -0,0 +1,207 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+namespace consts {
+const int64_t kTicksPerSec = sysconf(_SC_CLK_TCK);
+const int64_t kNsecPerSec = 1000000000;
+const size_t kDirBufferSize = 16 * 1024;
+}  // namespace consts
+
+// utime + stime in clock ticks, or -1 if the process is gone.
+inline int64_t ReadProcessCpuUsage(int pid) {
+    std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+    std::string content;
+    if (!std::getline(file, content)) {
+        return -1;
+    }
+    size_t close = content.rfind(')');
+    if (close == std::string::npos) {
+        return -1;
+    }
+    std::istringstream fields(content.substr(close + 1));
+    std::string skip;
+    for (int i = 0; i < 11; ++i) {
+        fields >> skip;
+    }
+
+    int64_t utime, stime;
+    if (fields >> utime >> stime) {
+        return utime + stime;
+    }
+    return -1;
+}
+
+// Every thread of every target may keep a schedstat fd open, so cpulimit takes
+// all the fds it is allowed. Returns the previous limit, for commands it
+// launches.
+inline rlimit RaiseFdLimit() {
+    rlimit limit{};
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        rlimit raised = limit;
+        raised.rlim_cur = raised.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &raised);
+    }
+    return limit;
+}
+
+// Runtime of one process in nanoseconds, summed over its threads from
+// /proc/<pid>/task/<tid>/schedstat. The task directory and the schedstat files
+// stay open between samples, so a sample costs one getdents plus one pread per
+// thread. Cached files are capped at half the fd limit across all clocks;
+// past that a thread's file is opened for each read. Where schedstat is
+// missing, utime + stime from stat is used instead.
+class ProcessClock {
+public:
+    explicit ProcessClock(int pid) : pid_(pid) {
+        std::string path = "/proc/" + std::to_string(pid);
+        if (access((path + "/schedstat").c_str(), R_OK) == 0) {
+            dir_fd_ = open((path + "/task").c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        }
+    }
+
+    ProcessClock(const ProcessClock&) = delete;
+    ProcessClock& operator=(const ProcessClock&) = delete;
+
+    ~ProcessClock() {
+        for (const auto& [tid, task] : tasks_) {
+            Uncache(task);
+        }
+        if (dir_fd_ >= 0) {
+            close(dir_fd_);
+        }
+    }
+
+    // Nanoseconds of CPU used since the previous call; the first call only
+    // takes the baseline and returns 0. Threads that appeared in between are
+    // counted from their start.
+    int64_t TakeDiff() {
+        int64_t diff = dir_fd_ >= 0 ? SumTasks() : SumStat();
+        bool primed = primed_;
+        primed_ = true;
+        return primed ? diff : 0;
+    }
+
+private:
+    struct Task {
+        int fd = -1;
+        // Whether last_ns holds a reading. Threads that appear after the
+        // baseline start from zero, the others from their first reading.
+        bool counted = false;
+        int64_t last_ns = 0;
+        uint64_t last_seen = 0;
+    };
+
+    int64_t SumTasks() {
+        ++generation_;
+        int64_t diff = 0;
+        char buffer[consts::kDirBufferSize];
+        lseek(dir_fd_, 0, SEEK_SET);
+        int64_t size;
+        while ((size = syscall(SYS_getdents64, dir_fd_, buffer, sizeof(buffer))) > 0) {
+            for (int64_t offset = 0; offset < size;) {
+                auto* entry = reinterpret_cast<struct dirent64*>(buffer + offset);
+                offset += entry->d_reclen;
+                int tid = 0;
+                if (sscanf(entry->d_name, "%d", &tid) != 1) {
+                    continue;
+                }
+                auto [it, inserted] = tasks_.try_emplace(tid);
+                Task& task = it->second;
+                task.last_seen = generation_;
+                if (inserted) {
+                    task.counted = primed_;
+                }
+                // A thread that cannot be read now, say for lack of fds, is
+                // tried again next time and its runtime caught up then.
+                int64_t ns = ReadTask(task, entry->d_name);
+                if (ns < 0) {
+                    continue;
+                }
+                if (task.counted) {
+                    diff += ns - task.last_ns;
+                }
+                task.last_ns = ns;
+                task.counted = true;
+            }
+        }
+        std::erase_if(tasks_, [this](const auto& item) {
+            if (item.second.last_seen == generation_) {
+                return false;
+            }
+            Uncache(item.second);
+            return true;
+        });
+        return diff;
+    }
+
+    int64_t ReadTask(Task& task, const char* tid) {
+        if (task.fd >= 0) {
+            return ReadRuntime(task.fd);
+        }
+        std::string name = std::string(tid) + "/schedstat";
+        int fd = openat(dir_fd_, name.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        int64_t ns = ReadRuntime(fd);
+        rlimit limit{};
+        if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && cached_fds_ < limit.rlim_cur / 2) {
+            task.fd = fd;
+            ++cached_fds_;
+        } else {
+            close(fd);
+        }
+        return ns;
+    }
+
+    static void Uncache(const Task& task) {
+        if (task.fd >= 0) {
+            close(task.fd);
+            --cached_fds_;
+        }
+    }
+
+    int64_t SumStat() {
+        int64_t ticks = ReadProcessCpuUsage(pid_);
+        if (ticks < 0) {
+            return 0;
+        }
+        int64_t ns = ticks * consts::kNsecPerSec / consts::kTicksPerSec;
+        int64_t diff = ns - stat_ns_;
+        stat_ns_ = ns;
+        return diff;
+    }
+
+    // The first field of schedstat is the time spent on the CPU in nanoseconds.
+    static int64_t ReadRuntime(int fd) {
+        char buffer[64];
+        ssize_t size = pread(fd, buffer, sizeof(buffer) - 1, 0);
+        if (size <= 0) {
+            return -1;
+        }
+        buffer[size] = '\0';
+        return std::strtoll(buffer, nullptr, 10);
+    }
+
+    int pid_;
+    int dir_fd_ = -1;
+    bool primed_ = false;
+    int64_t stat_ns_ = 0;
+    uint64_t generation_ = 0;
+    std::unordered_map<int, Task> tasks_;
+    static inline size_t cached_fds_ = 0;
+};
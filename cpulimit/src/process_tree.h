@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <dirent.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include "errors.h"
+
+namespace consts {
+const auto kYoungTime = std::chrono::seconds(3);
+const auto kListingInterval = std::chrono::milliseconds(500);
+}  // namespace consts
+
+// Persistent pid -> ppid view of the process table. A process joins the group
+// of the name its comm matches, or the group its parent is already in, so
+// descendants of a named executable are limited too and stay so after being
+// reparented. Names are indexed like the groups; empty names match nothing.
+//
+// A tick follows the members' /proc/<pid>/task/<tid>/children and so touches
+// only the groups' own entries. Matches elsewhere are found by listing /proc:
+// every tick while there are no members yet, otherwise every
+// kListingInterval, and never without names. The interval is shorter than an
+// idle tick, so that idle ticks still list every time. A listing opens only
+// the pids that appeared since the previous one, and freshly forked ones
+// again for kYoungTime, since they usually exec shortly afterwards; a process
+// renamed later than that is not picked up. Kernels without the children
+// files (CONFIG_PROC_CHILDREN) get a listing every tick.
+class ProcessTree {
+public:
+    explicit ProcessTree(std::vector<std::string> names, std::string proc_root = "/proc")
+        : names_(std::move(names)),
+          proc_root_(std::move(proc_root)),
+          follow_children_(access((proc_root_ + "/thread-self/children").c_str(), R_OK) == 0),
+          any_names_(std::any_of(names_.begin(), names_.end(),
+                                 [](const std::string& name) { return !name.empty(); })) {
+    }
+
+    // Puts pid into a group regardless of its name, so that its descendants
+    // join that group as they appear.
+    void Adopt(int pid, int group) {
+        Node& node = nodes_[pid];
+        node.group = group;
+        node.reported = true;
+        node.forgotten = false;
+        node.last_seen = scan_;
+        members_.insert(pid);
+    }
+
+    // Takes pid out of its group for good: neither it, whatever its name, nor
+    // the children it forks from now on join a group again.
+    void Forget(int pid) {
+        Node& node = nodes_[pid];
+        node.group = -1;
+        node.reported = true;
+        node.forgotten = true;
+        node.last_seen = scan_;
+        members_.erase(pid);
+    }
+
+    // Returns the (pid, group index) pairs that joined during this scan.
+    std::vector<std::pair<int, int>> Update() {
+        ++scan_;
+        // Ages are kept in time rather than in scans, since ticks get longer
+        // while the targets are idle.
+        auto now = std::chrono::steady_clock::now();
+        std::vector<std::pair<int, int>> joined;
+        if (!follow_children_ || (any_names_ && (members_.empty() || now >= next_listing_))) {
+            next_listing_ = now + consts::kListingInterval;
+            List(now, joined);
+        }
+        if (follow_children_) {
+            FollowChildren(joined);
+        }
+        return joined;
+    }
+
+private:
+    struct Node {
+        int ppid = 0;
+        int group = -1;
+        bool reported = false;
+        bool forgotten = false;
+        std::chrono::steady_clock::time_point young_until;
+        uint64_t last_seen = 0;
+    };
+
+    void List(std::chrono::steady_clock::time_point now,
+              std::vector<std::pair<int, int>>& joined) {
+        std::vector<int> fresh;
+        DIR* dir = opendir(proc_root_.c_str());
+        if (dir == nullptr) {
+            errors::Exit("ProcessTree", "opendir " + proc_root_);
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            int pid = 0;
+            if (sscanf(entry->d_name, "%d", &pid) != 1) {
+                continue;
+            }
+            auto [it, inserted] = nodes_.try_emplace(pid);
+            Node& node = it->second;
+            node.last_seen = scan_;
+            if (inserted) {
+                node.young_until = now + consts::kYoungTime;
+            }
+            if (node.group >= 0 || node.forgotten || (!inserted && now >= node.young_until)) {
+                continue;
+            }
+            std::string comm;
+            if (!ReadIdentity(pid, comm, node.ppid)) {
+                continue;
+            }
+            auto name = std::find(names_.begin(), names_.end(), comm);
+            if (!comm.empty() && name != names_.end()) {
+                node.group = static_cast<int>(name - names_.begin());
+            }
+            fresh.push_back(pid);
+        }
+        closedir(dir);
+        std::erase_if(nodes_, [this](const auto& item) {
+            if (item.second.last_seen == scan_) {
+                return false;
+            }
+            members_.erase(item.first);
+            return true;
+        });
+
+        // Parents and children can show up in the same scan in any order.
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int pid : fresh) {
+                Node& node = nodes_[pid];
+                if (node.group >= 0 && !node.reported) {
+                    node.reported = true;
+                    members_.insert(pid);
+                    joined.emplace_back(pid, node.group);
+                    changed = true;
+                    continue;
+                }
+                auto parent = nodes_.find(node.ppid);
+                if (node.group < 0 && parent != nodes_.end() && parent->second.group >= 0) {
+                    node.group = parent->second.group;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Members that are gone are dropped; children that joined are followed in
+    // turn, so a whole new subtree joins in one tick.
+    void FollowChildren(std::vector<std::pair<int, int>>& joined) {
+        std::vector<int> pending(members_.begin(), members_.end());
+        while (!pending.empty()) {
+            int pid = pending.back();
+            pending.pop_back();
+            std::vector<int> children;
+            if (!ReadChildren(pid, children)) {
+                nodes_.erase(pid);
+                members_.erase(pid);
+                continue;
+            }
+            int group = nodes_[pid].group;
+            for (int child : children) {
+                Node& node = nodes_[child];
+                node.last_seen = scan_;
+                if (node.group >= 0 || node.forgotten) {
+                    continue;
+                }
+                node.ppid = pid;
+                node.group = group;
+                node.reported = true;
+                members_.insert(child);
+                joined.emplace_back(child, group);
+                pending.push_back(child);
+            }
+        }
+    }
+
+    // False if pid is gone.
+    bool ReadChildren(int pid, std::vector<int>& children) const {
+        std::string task = proc_root_ + "/" + std::to_string(pid) + "/task";
+        DIR* dir = opendir(task.c_str());
+        if (dir == nullptr) {
+            return false;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+            std::ifstream file(task + "/" + entry->d_name + "/children");
+            int child;
+            while (file >> child) {
+                children.push_back(child);
+            }
+        }
+        closedir(dir);
+        return true;
+    }
+
+    bool ReadIdentity(int pid, std::string& comm, int& ppid) const {
+        std::ifstream file(proc_root_ + "/" + std::to_string(pid) + "/stat");
+        std::string content;
+        if (!std::getline(file, content)) {
+            return false;
+        }
+        size_t open = content.find('(');
+        size_t close = content.rfind(')');
+        if (open == std::string::npos || close == std::string::npos || close < open) {
+            return false;
+        }
+        comm = content.substr(open + 1, close - open - 1);
+        std::istringstream rest(content.substr(close + 1));
+        char state;
+        return static_cast<bool>(rest >> state >> ppid);
+    }
+
+    std::vector<std::string> names_;
+    std::string proc_root_;
+    bool follow_children_;
+    bool any_names_;
+    std::unordered_map<int, Node> nodes_;
+    std::unordered_set<int> members_;
+    uint64_t scan_ = 0;
+    std::chrono::steady_clock::time_point next_listing_;
+};
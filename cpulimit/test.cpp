@@ -1,4 +1,1094 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include <gtest/gtest.h>
 
-TEST(NotYetReady, NotYetReady) {
+#include "src/cgroup_throttle.h"
+#include "src/duty_controller.h"
+#include "src/process_clock.h"
+#include "src/process_tree.h"
+
+#ifndef CPULIMIT_PATH
+#define CPULIMIT_PATH "./cpulimit"
+#endif
+
+// A busy-looping process named `name`, optionally with one busy-looping child
+// named `child_name`. Everything is killed through the process group.
+class Burner {
+public:
+    explicit Burner(const std::string& name, const std::string& child_name = "") {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            throw std::runtime_error("pipe failed");
+        }
+        pid_ = fork();
+        if (pid_ == 0) {
+            setpgid(0, 0);
+            prctl(PR_SET_NAME, name.c_str());
+            pid_t child = 0;
+            if (!child_name.empty() && (child = fork()) == 0) {
+                prctl(PR_SET_NAME, child_name.c_str());
+                Spin();
+            }
+            write(fds[1], &child, sizeof(child));
+            Spin();
+        }
+        close(fds[1]);
+        read(fds[0], &child_pid_, sizeof(child_pid_));
+        close(fds[0]);
+    }
+
+    ~Burner() {
+        kill(-pid_, SIGKILL);
+        waitpid(pid_, nullptr, 0);
+    }
+
+    pid_t Pid() const {
+        return pid_;
+    }
+
+    pid_t ChildPid() const {
+        return child_pid_;
+    }
+
+    // utime + stime of the burner and its child, in seconds.
+    double CpuSeconds() const {
+        double total = Ticks(pid_);
+        if (child_pid_ != 0) {
+            total += Ticks(child_pid_);
+        }
+        return total / sysconf(_SC_CLK_TCK);
+    }
+
+    char State(pid_t pid) const {
+        std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+        std::string content;
+        std::getline(file, content);
+        return content.at(content.rfind(')') + 2);
+    }
+
+private:
+    [[noreturn]] static void Spin() {
+        volatile uint64_t counter = 0;
+        while (true) {
+            counter = counter + 1;
+        }
+    }
+
+    static int64_t Ticks(pid_t pid) {
+        std::ifstream file("/proc/" + std::to_string(pid) + "/stat");
+        std::string content;
+        std::getline(file, content);
+        std::istringstream fields(content.substr(content.rfind(')') + 2));
+        std::string skip;
+        for (int i = 0; i < 11; ++i) {
+            fields >> skip;
+        }
+        int64_t utime = 0, stime = 0;
+        fields >> utime >> stime;
+        return utime + stime;
+    }
+
+    pid_t pid_ = 0;
+    pid_t child_pid_ = 0;
+};
+
+class Cpulimit {
+public:
+    explicit Cpulimit(const std::vector<std::string>& args,
+                      const std::string& stdout_path = "/dev/null") {
+        pid_ = fork();
+        if (pid_ == 0) {
+            int output = open(stdout_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            dup2(output, STDOUT_FILENO);
+            std::vector<char*> argv = {const_cast<char*>(CPULIMIT_PATH)};
+            for (const auto& arg : args) {
+                argv.push_back(const_cast<char*>(arg.c_str()));
+            }
+            argv.push_back(nullptr);
+            execv(CPULIMIT_PATH, argv.data());
+            _exit(127);
+        }
+    }
+
+    ~Cpulimit() {
+        Stop();
+    }
+
+    pid_t Pid() const {
+        return pid_;
+    }
+
+    int Stop() {
+        if (pid_ != 0) {
+            kill(pid_, SIGTERM);
+            Wait();
+        }
+        return status_;
+    }
+
+    int Wait() {
+        if (pid_ != 0) {
+            waitpid(pid_, &status_, 0);
+            pid_ = 0;
+        }
+        return status_;
+    }
+
+private:
+    pid_t pid_ = 0;
+    int status_ = -1;
+};
+
+double MeasureCpu(const Burner& burner, std::chrono::milliseconds duration) {
+    double start = burner.CpuSeconds();
+    std::this_thread::sleep_for(duration);
+    return (burner.CpuSeconds() - start) / std::chrono::duration<double>(duration).count();
+}
+
+TEST(Cpulimit, ExecCoversDescendants) {
+    Burner burner("cl_parent", "cl_child");
+    Cpulimit cpulimit({"-e", "cl_parent", "-l", "20"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    double usage = MeasureCpu(burner, std::chrono::seconds(2));
+    EXPECT_LT(usage, 0.35);
+    EXPECT_GT(usage, 0.05);
+
+    cpulimit.Stop();
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    EXPECT_NE(burner.State(burner.Pid()), 'T');
+    EXPECT_NE(burner.State(burner.ChildPid()), 'T');
+}
+
+TEST(Cpulimit, FinishesWhenTargetExits) {
+    auto burner = std::make_unique<Burner>("cl_short");
+    Cpulimit cpulimit({"-p", std::to_string(burner->Pid()), "-l", "30"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+    burner.reset();
+
+    auto start = std::chrono::steady_clock::now();
+    int status = cpulimit.Wait();
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::seconds(1));
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 0);
+}
+
+TEST(Cpulimit, ConfigRunsSeveralGroups) {
+    Burner by_pid("cl_by_pid");
+    Burner by_name("cl_by_name");
+    std::string config = "/tmp/cpulimit_test_" + std::to_string(getpid()) + ".conf";
+    std::ofstream(config) << "# kind target limit\n"
+                          << "pid " << by_pid.Pid() << " 15\n"
+                          << "exe cl_by_name 30\n";
+    Cpulimit cpulimit({"--config=" + config});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    double by_pid_start = by_pid.CpuSeconds();
+    double usage = MeasureCpu(by_name, std::chrono::seconds(2));
+    double by_pid_usage = (by_pid.CpuSeconds() - by_pid_start) / 2;
+    EXPECT_NEAR(by_pid_usage, 0.15, 0.07);
+    EXPECT_NEAR(usage, 0.30, 0.07);
+    std::remove(config.c_str());
+}
+
+TEST(Cpulimit, StaggersStopWindows) {
+    Burner first("cl_stagger");
+    Burner second("cl_stagger");
+    Cpulimit cpulimit({"-e", "cl_stagger", "-l", "50"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // With synchronised stops both members are always in the same state; with
+    // staggered phases one runs while the other is stopped for much of a period.
+    int mixed = 0;
+    int samples = 0;
+    double start = first.CpuSeconds() + second.CpuSeconds();
+    for (; samples < 400; ++samples) {
+        mixed += (first.State(first.Pid()) == 'T') != (second.State(second.Pid()) == 'T');
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    double usage = (first.CpuSeconds() + second.CpuSeconds() - start) / (samples * 0.005);
+    EXPECT_GT(mixed, samples / 5);
+    EXPECT_LT(usage, 0.65);
+}
+
+TEST(Cpulimit, WeightedShares) {
+    Burner heavy("cl_weighted");
+    Burner light("cl_weighted");
+    Cpulimit cpulimit(
+        {"-e", "cl_weighted", "-l", "40", "--weight=" + std::to_string(heavy.Pid()) + ":3"});
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+
+    double light_start = light.CpuSeconds();
+    double heavy_usage = MeasureCpu(heavy, std::chrono::seconds(2));
+    double light_usage = (light.CpuSeconds() - light_start) / 2;
+    EXPECT_NEAR(heavy_usage + light_usage, 0.40, 0.08);
+    EXPECT_GT(heavy_usage, 2 * light_usage);
+}
+
+TEST(Cpulimit, LaunchPropagatesExitStatus) {
+    Cpulimit exits({"-l", "30", "--", "sh", "-c", "exit 7"});
+    int status = exits.Wait();
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), 7);
+
+    Cpulimit killed({"-l", "30", "--", "sh", "-c", "kill -TERM $$"});
+    status = killed.Wait();
+    ASSERT_TRUE(WIFSIGNALED(status));
+    EXPECT_EQ(WTERMSIG(status), SIGTERM);
+}
+
+// The summary and exit message go to stderr, leaving stdout to the command.
+TEST(Cpulimit, LaunchLeavesStdoutToCommand) {
+    std::string path = "/tmp/cpulimit_stdout_" + std::to_string(getpid());
+    Cpulimit cpulimit({"-l", "30", "--", "sh", "-c", "echo hello"}, path);
+    ASSERT_TRUE(WIFEXITED(cpulimit.Wait()));
+
+    std::ifstream file(path);
+    std::stringstream output;
+    output << file.rdbuf();
+    EXPECT_EQ(output.str(), "hello\n");
+    std::remove(path.c_str());
+}
+
+// cpulimit raises its own fd limit, but not the command's.
+TEST(Cpulimit, LaunchKeepsFdLimit) {
+    std::string path = "/tmp/cpulimit_nofile_" + std::to_string(getpid());
+    struct rlimit saved;
+    getrlimit(RLIMIT_NOFILE, &saved);
+    struct rlimit lowered = saved;
+    lowered.rlim_cur = std::min<rlim_t>(saved.rlim_cur, 256);
+    setrlimit(RLIMIT_NOFILE, &lowered);
+    Cpulimit cpulimit({"-l", "30", "--", "sh", "-c", "ulimit -n > " + path});
+    setrlimit(RLIMIT_NOFILE, &saved);
+    ASSERT_TRUE(WIFEXITED(cpulimit.Wait()));
+
+    std::ifstream file(path);
+    rlim_t limit = 0;
+    file >> limit;
+    EXPECT_EQ(limit, lowered.rlim_cur);
+    std::remove(path.c_str());
+}
+
+// The child's CPU time reaches us through cpulimit's waitid, so the ratio
+// below covers the command from exec to exit.
+TEST(Cpulimit, LaunchLimitsFromStart) {
+    auto start = std::chrono::steady_clock::now();
+    struct rusage before;
+    getrusage(RUSAGE_CHILDREN, &before);
+    std::string loop = "i=0; while [ $i -lt 200000 ]; do i=$((i+1)); done";
+    Cpulimit cpulimit({"-l", "25", "--", "sh", "-c", loop});
+    ASSERT_TRUE(WIFEXITED(cpulimit.Wait()));
+    struct rusage after;
+    getrusage(RUSAGE_CHILDREN, &after);
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double cpu = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) +
+                 (after.ru_utime.tv_usec - before.ru_utime.tv_usec) / 1e6;
+    EXPECT_NEAR(cpu / wall, 0.25, 0.1);
+}
+
+// Reads and writes give up after two seconds, so a stalled cpulimit fails the
+// test rather than hanging it.
+int ConnectControl(const std::string& path) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    struct timeval timeout = {2, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+// Sends one command to the control socket and returns the reply up to and
+// including its final "ok" or "error" line.
+std::string Control(const std::string& path, const std::string& command) {
+    int fd = ConnectControl(path);
+    if (fd < 0) {
+        return "";
+    }
+    std::string request = command + "\n";
+    write(fd, request.data(), request.size());
+    std::string reply;
+    char buffer[4096];
+    ssize_t size;
+    while (reply.find("ok\n") == std::string::npos && reply.find("error") == std::string::npos &&
+           (size = read(fd, buffer, sizeof(buffer))) > 0) {
+        reply.append(buffer, size);
+    }
+    close(fd);
+    return reply;
+}
+
+TEST(Cpulimit, ControlSocket) {
+    Burner burner("cl_control");
+    std::string path = "/tmp/cpulimit_test_" + std::to_string(getpid()) + ".sock";
+    Cpulimit cpulimit({"-p", std::to_string(burner.Pid()), "-l", "20", "--control=" + path});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::string status = Control(path, "status");
+    EXPECT_NE(status.find("group 0 target=" + std::to_string(burner.Pid()) + " limit=20 "),
+              std::string::npos)
+        << status;
+    EXPECT_EQ(Control(path, "limit 0 60"), "ok\n");
+    EXPECT_EQ(Control(path, "limit 3 60").rfind("error", 0), 0u);
+    EXPECT_EQ(Control(path, "frobnicate").rfind("error", 0), 0u);
+    EXPECT_EQ(Control(path, "add 0 12.7").rfind("error", 0), 0u);
+    EXPECT_EQ(Control(path, "remove 0 pid").rfind("error", 0), 0u);
+
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    EXPECT_NEAR(MeasureCpu(burner, std::chrono::seconds(2)), 0.60, 0.08);
+    EXPECT_EQ(Control(path, "remove 0 " + std::to_string(burner.Pid())), "ok\n");
+
+    cpulimit.Stop();
+    EXPECT_NE(access(path.c_str(), F_OK), 0);
+}
+
+// Sleeps under `name` until Fork() makes it fork a child named `child_name`.
+class Forker {
+public:
+    Forker(const std::string& name, const std::string& child_name) {
+        if (pipe(request_) != 0 || pipe(reply_) != 0) {
+            throw std::runtime_error("pipe failed");
+        }
+        pid_ = fork();
+        if (pid_ == 0) {
+            setpgid(0, 0);
+            prctl(PR_SET_NAME, name.c_str());
+            char byte;
+            read(request_[0], &byte, 1);
+            pid_t child = fork();
+            if (child == 0) {
+                prctl(PR_SET_NAME, child_name.c_str());
+                pause();
+            }
+            write(reply_[1], &child, sizeof(child));
+            pause();
+        }
+    }
+
+    ~Forker() {
+        kill(-pid_, SIGKILL);
+        waitpid(pid_, nullptr, 0);
+        for (int fd : {request_[0], request_[1], reply_[0], reply_[1]}) {
+            close(fd);
+        }
+    }
+
+    pid_t Pid() const {
+        return pid_;
+    }
+
+    pid_t Fork() {
+        char byte = 0;
+        write(request_[1], &byte, 1);
+        pid_t child = 0;
+        read(reply_[0], &child, sizeof(child));
+        return child;
+    }
+
+private:
+    pid_t pid_ = 0;
+    int request_[2] = {-1, -1};
+    int reply_[2] = {-1, -1};
+};
+
+std::vector<std::string> Members(const std::string& status) {
+    size_t start = status.find("members=");
+    if (start == std::string::npos) {
+        return {};
+    }
+    start += std::string("members=").size();
+    std::istringstream list(status.substr(start, status.find('\n', start) - start));
+    std::vector<std::string> members;
+    std::string pid;
+    while (std::getline(list, pid, ',')) {
+        members.push_back(pid);
+    }
+    return members;
+}
+
+// A removed process stays out of its group, and so do the children it forks
+// afterwards.
+TEST(Cpulimit, ControlRemove) {
+    Burner burner("cl_remove");
+    Forker forker("cl_remove", "cl_removed_kid");
+    std::string path = "/tmp/cpulimit_remove_" + std::to_string(getpid()) + ".sock";
+    Cpulimit cpulimit({"-e", "cl_remove", "-l", "20", "--control=" + path});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    std::string forker_pid = std::to_string(forker.Pid());
+    std::vector<std::string> members = Members(Control(path, "status"));
+    ASSERT_NE(std::find(members.begin(), members.end(), forker_pid), members.end());
+    EXPECT_EQ(Control(path, "remove 0 " + forker_pid), "ok\n");
+
+    std::string kid_pid = std::to_string(forker.Fork());
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    members = Members(Control(path, "status"));
+    EXPECT_NE(std::find(members.begin(), members.end(), std::to_string(burner.Pid())),
+              members.end());
+    EXPECT_EQ(std::find(members.begin(), members.end(), forker_pid), members.end());
+    EXPECT_EQ(std::find(members.begin(), members.end(), kid_pid), members.end());
+}
+
+// A client that sends requests without reading the replies stalls neither the
+// limiter nor other clients, and is dropped once its replies pile up; one that
+// reads them late still gets every one.
+TEST(Cpulimit, ControlSlowClients) {
+    Burner burner("cl_slow_client");
+    std::string path = "/tmp/cpulimit_slow_" + std::to_string(getpid()) + ".sock";
+    Cpulimit cpulimit({"-p", std::to_string(burner.Pid()), "-l", "20", "--control=" + path});
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+
+    // Far more than a socket buffer holds, but under cpulimit's own limit.
+    int late = ConnectControl(path);
+    ASSERT_GE(late, 0);
+    std::string requests;
+    for (int i = 0; i < 300; ++i) {
+        requests += "history 0 600\n";
+    }
+    ASSERT_EQ(send(late, requests.data(), requests.size(), MSG_NOSIGNAL),
+              static_cast<ssize_t>(requests.size()));
+
+    int stuck = ConnectControl(path);
+    ASSERT_GE(stuck, 0);
+    std::string flood;
+    for (int i = 0; i < 20000; ++i) {
+        flood += "history 0 600\n";
+    }
+    for (size_t sent = 0; sent < flood.size();) {
+        ssize_t size = send(stuck, flood.data() + sent, flood.size() - sent, MSG_NOSIGNAL);
+        if (size <= 0) {
+            break;
+        }
+        sent += size;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_NE(Control(path, "status").find("group 0"), std::string::npos);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(500));
+    EXPECT_NEAR(MeasureCpu(burner, std::chrono::seconds(2)), 0.20, 0.08);
+
+    char buffer[65536];
+    ssize_t size;
+    while ((size = read(stuck, buffer, sizeof(buffer))) > 0) {
+    }
+    EXPECT_EQ(size, 0) << "still connected";
+    close(stuck);
+
+    int replies = 0;
+    std::string tail;
+    while (replies < 300 && (size = read(late, buffer, sizeof(buffer))) > 0) {
+        tail.append(buffer, size);
+        size_t end;
+        while ((end = tail.find('\n')) != std::string::npos) {
+            replies += tail.compare(0, end, "ok") == 0;
+            tail.erase(0, end + 1);
+        }
+    }
+    EXPECT_EQ(replies, 300);
+    close(late);
+}
+
+TEST(Cpulimit, CatchesUpAfterIdleBackoff) {
+    pid_t sleeper = fork();
+    if (sleeper == 0) {
+        prctl(PR_SET_NAME, "cl_late");
+        pause();
+        _exit(0);
+    }
+    Cpulimit cpulimit({"-e", "cl_late", "-l", "20"});
+    // Long enough for the idle group to back off to its longest tick.
+    std::this_thread::sleep_for(std::chrono::seconds(3));
+
+    // The newcomer may run freely until the end of the current long tick.
+    Burner burner("cl_late");
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    double usage = MeasureCpu(burner, std::chrono::seconds(2));
+    EXPECT_LT(usage, 0.35);
+    EXPECT_GT(usage, 0.05);
+
+    kill(sleeper, SIGKILL);
+    waitpid(sleeper, nullptr, 0);
+}
+
+TEST(Cpulimit, WritesTelemetry) {
+    Burner burner("cl_telemetry");
+    std::string path = "/tmp/cpulimit_test_" + std::to_string(getpid()) + ".csv";
+    Cpulimit cpulimit({"-p", std::to_string(burner.Pid()), "-l", "25", "--telemetry=" + path});
+    std::this_thread::sleep_for(std::chrono::seconds(2));
+    cpulimit.Stop();
+
+    std::ifstream file(path);
+    std::string line;
+    std::getline(file, line);
+    EXPECT_EQ(line, "time_s,group,limit_pct,budget_pct,usage_pct,stopped_s,members");
+    int periods = 0;
+    double usage_sum = 0;
+    while (std::getline(file, line)) {
+        double time_secs, limit, budget, usage, stopped_secs;
+        int group, members;
+        ASSERT_EQ(sscanf(line.c_str(), "%lf,%d,%lf,%lf,%lf,%lf,%d", &time_secs, &group, &limit,
+                         &budget, &usage, &stopped_secs, &members),
+                  7)
+            << line;
+        EXPECT_EQ(group, 0);
+        EXPECT_EQ(limit, 25);
+        EXPECT_EQ(members, 1);
+        ++periods;
+        usage_sum += usage;
+    }
+    EXPECT_GE(periods, 15);
+    EXPECT_NEAR(usage_sum / periods, 25, 8);
+    std::remove(path.c_str());
+}
+
+TEST(Cpulimit, CgroupBackendLimits) {
+    Burner burner("cl_cgroup");
+    Cpulimit cpulimit({"-p", std::to_string(burner.Pid()), "-l", "20", "--backend=cgroup"});
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+    // Whether the cgroup is usable here or cpulimit fell back to signals, the
+    // limit holds.
+    double usage = MeasureCpu(burner, std::chrono::seconds(2));
+    EXPECT_LT(usage, 0.35);
+    EXPECT_GT(usage, 0.05);
+}
+
+TEST(Cpulimit, CgroupBackendRejectsSignalOptions) {
+    Burner burner("cl_cgroup_opts");
+    for (std::string option : {"--fair", "--weight=1:2", "--control=/tmp/cl.sock",
+                               "--telemetry=/tmp/cl.csv"}) {
+        Cpulimit cpulimit(
+            {"-p", std::to_string(burner.Pid()), "-l", "20", "--backend=cgroup", option});
+        int status = cpulimit.Wait();
+        ASSERT_TRUE(WIFEXITED(status)) << option;
+        EXPECT_EQ(WEXITSTATUS(status), EXIT_FAILURE) << option;
+    }
+}
+
+TEST(Cpulimit, CgroupBackendWithoutMatches) {
+    Cpulimit cpulimit({"-e", "cl_nonexistent", "-l", "20", "--backend=cgroup"});
+    int status = cpulimit.Wait();
+    ASSERT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(WEXITSTATUS(status), EXIT_FAILURE);
+}
+
+TEST(CgroupThrottle, CpuMax) {
+    EXPECT_EQ(CgroupThrottle::CpuMax(0.2), "20000 100000");
+    EXPECT_EQ(CgroupThrottle::CpuMax(0.29), "29000 100000");
+    EXPECT_EQ(CgroupThrottle::CpuMax(2.5), "250000 100000");
+    EXPECT_EQ(CgroupThrottle::CpuMax(0.0001), "1000 100000");
+}
+
+class TempDir {
+public:
+    TempDir() {
+        std::string tmp = (std::filesystem::temp_directory_path() / "cpulimitXXXXXX").string();
+        if (mkdtemp(tmp.data()) == nullptr) {
+            throw std::runtime_error("mkdtemp failed");
+        }
+        path_ = tmp;
+    }
+
+    ~TempDir() {
+        std::filesystem::remove_all(path_);
+    }
+
+    const std::filesystem::path& Path() const {
+        return path_;
+    }
+
+private:
+    std::filesystem::path path_;
+};
+
+// A cgroup2 hierarchy and the matching /proc/<pid>/cgroup files in a temp
+// dir. Unlike cgroupfs it keeps whatever is written to a control file, and
+// its directories can only be removed once those files are gone.
+class FakeCgroups {
+public:
+
+    std::string Mount() const {
+        return (root_ / "cgroup").string();
+    }
+
+    std::string ProcRoot() const {
+        return (root_ / "proc").string();
+    }
+
+    void AddCgroup(const std::string& path, const std::string& controllers,
+                   const std::string& subtree_control = "") {
+        std::filesystem::path dir = Mount() + path;
+        std::filesystem::create_directories(dir);
+        std::ofstream(dir / "cgroup.controllers") << controllers << "\n";
+        std::ofstream(dir / "cgroup.subtree_control") << subtree_control << "\n";
+    }
+
+    void AddProcess(int pid, const std::string& cgroup) {
+        std::filesystem::path dir = root_ / "proc" / std::to_string(pid);
+        std::filesystem::create_directories(dir);
+        std::ofstream(dir / "cgroup") << "0::" << cgroup << "\n";
+    }
+
+    std::string Read(const std::string& path) const {
+        std::ifstream file(Mount() + path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+    bool Exists(const std::string& path) const {
+        return std::filesystem::exists(Mount() + path);
+    }
+
+    // What the kernel does on rmdir.
+    void DropFiles(const std::string& path) {
+        for (const auto& entry : std::filesystem::directory_iterator(Mount() + path)) {
+            std::filesystem::remove(entry.path());
+        }
+    }
+
+private:
+    TempDir dir_;
+    const std::filesystem::path& root_ = dir_.Path();
+};
+
+TEST(CgroupThrottle, LeafUnderTargetCgroup) {
+    FakeCgroups cgroups;
+    cgroups.AddCgroup("", "cpu memory");
+    cgroups.AddProcess(4242, "/");
+    cgroups.AddProcess(4343, "/user.slice");
+    std::string leaf = "/cpulimit." + std::to_string(getpid());
+
+    CgroupThrottle throttle(cgroups.Mount(), cgroups.ProcRoot());
+    ASSERT_TRUE(throttle.Setup(0.25));
+    EXPECT_FALSE(cgroups.Exists(leaf));
+    ASSERT_TRUE(throttle.Attach(4242));
+    EXPECT_EQ(cgroups.Read("/cgroup.subtree_control"), "+cpu");
+    EXPECT_EQ(cgroups.Read(leaf + "/cpu.max"), "25000 100000");
+    EXPECT_EQ(cgroups.Read(leaf + "/cgroup.procs"), "4242");
+    // Moving it out of its own cgroup would lift that cgroup's limits.
+    EXPECT_FALSE(throttle.Attach(4343));
+
+    cgroups.DropFiles(leaf);
+    throttle.Release();
+    EXPECT_FALSE(cgroups.Exists(leaf));
+    EXPECT_EQ(cgroups.Read("/cgroup.procs"), "4242");
+    EXPECT_EQ(cgroups.Read("/cgroup.subtree_control"), "-cpu");
+}
+
+TEST(CgroupThrottle, DelegatedParent) {
+    FakeCgroups cgroups;
+    cgroups.AddCgroup("", "cpu memory", "cpu memory");
+    cgroups.AddCgroup("/user.slice", "cpu memory");
+    cgroups.AddCgroup("/delegated", "cpu memory", "cpu");
+    cgroups.AddProcess(4242, "/user.slice");
+    std::string leaf = "/delegated/cpulimit." + std::to_string(getpid());
+
+    CgroupThrottle throttle(cgroups.Mount(), cgroups.ProcRoot());
+    ASSERT_TRUE(throttle.Setup(0.5, "delegated/"));
+    ASSERT_TRUE(throttle.Attach(4242));
+    EXPECT_EQ(cgroups.Read(leaf + "/cpu.max"), "50000 100000");
+    EXPECT_EQ(cgroups.Read(leaf + "/cgroup.procs"), "4242");
+
+    cgroups.DropFiles(leaf);
+    throttle.Release();
+    EXPECT_FALSE(cgroups.Exists(leaf));
+    EXPECT_EQ(cgroups.Read("/user.slice/cgroup.procs"), "4242");
+    // Already enabled before, so left alone.
+    EXPECT_EQ(cgroups.Read("/delegated/cgroup.subtree_control"), "cpu");
+}
+
+// Both make the caller fall back to signals.
+TEST(CgroupThrottle, NoCpuController) {
+    FakeCgroups cgroups;
+    cgroups.AddCgroup("", "memory");
+    CgroupThrottle throttle(cgroups.Mount(), cgroups.ProcRoot());
+    EXPECT_FALSE(throttle.Setup(0.25));
+
+    FakeCgroups nested;
+    nested.AddCgroup("", "cpu memory", "memory");
+    nested.AddCgroup("/app", "memory");
+    nested.AddProcess(4242, "/app");
+    CgroupThrottle nested_throttle(nested.Mount(), nested.ProcRoot());
+    ASSERT_TRUE(nested_throttle.Setup(0.25));
+    EXPECT_FALSE(nested_throttle.Attach(4242));
+    EXPECT_FALSE(nested.Exists("/app/cpulimit." + std::to_string(getpid())));
+    EXPECT_EQ(nested.Read("/cgroup.subtree_control"), "memory");
+    EXPECT_EQ(nested.Read("/app/cgroup.subtree_control"), "");
+}
+
+// A /proc with stat and per-thread children files, or without the latter like
+// a kernel built without CONFIG_PROC_CHILDREN.
+class FakeProc {
+public:
+    explicit FakeProc(bool children_files) : children_files_(children_files) {
+        if (children_files_) {
+            std::filesystem::create_directories(Root() + "/thread-self");
+            std::ofstream(Root() + "/thread-self/children");
+        }
+    }
+
+    std::string Root() const {
+        return dir_.Path().string();
+    }
+
+    // Forked by the thread `tid` of ppid, the main one by default.
+    void Start(int pid, const std::string& comm, int ppid, int tid = 0) {
+        std::filesystem::create_directories(Root() + "/" + std::to_string(pid));
+        std::ofstream(Root() + "/" + std::to_string(pid) + "/stat")
+            << pid << " (" << comm << ") S " << ppid << " 0 0\n";
+        Thread(pid, pid);
+        if (ppid != 0) {
+            forked_by_[pid] = {ppid, tid == 0 ? ppid : tid};
+            children_[forked_by_[pid]].push_back(pid);
+            WriteChildren(forked_by_[pid]);
+        }
+    }
+
+    void Thread(int pid, int tid) {
+        std::filesystem::create_directories(Task(pid, tid));
+        WriteChildren({pid, tid});
+    }
+
+    void Exit(int pid) {
+        std::filesystem::remove_all(Root() + "/" + std::to_string(pid));
+        auto task = forked_by_.find(pid);
+        if (task != forked_by_.end()) {
+            std::erase(children_[task->second], pid);
+            WriteChildren(task->second);
+            forked_by_.erase(task);
+        }
+    }
+
+private:
+    std::string Task(int pid, int tid) const {
+        return Root() + "/" + std::to_string(pid) + "/task/" + std::to_string(tid);
+    }
+
+    void WriteChildren(std::pair<int, int> task) {
+        if (!children_files_ || !std::filesystem::exists(Task(task.first, task.second))) {
+            return;
+        }
+        std::ofstream file(Task(task.first, task.second) + "/children");
+        for (int child : children_[task]) {
+            file << child << " ";
+        }
+    }
+
+    TempDir dir_;
+    bool children_files_;
+    std::map<int, std::pair<int, int>> forked_by_;
+    std::map<std::pair<int, int>, std::vector<int>> children_;
+};
+
+using Joined = std::vector<std::pair<int, int>>;
+
+TEST(ProcessTree, FollowsChildren) {
+    FakeProc proc(true);
+    proc.Start(1, "init", 0);
+    proc.Start(100, "cl_app", 1);
+    proc.Start(200, "sh", 1);
+    ProcessTree tree({"", "cl_app"}, proc.Root());
+    EXPECT_EQ(tree.Update(), (Joined{{100, 1}}));
+
+    // Children of any thread, and theirs, join on the next tick. Between
+    // listings nothing else is looked at: neither a new match elsewhere nor
+    // a young process that execs into the name.
+    proc.Start(101, "worker", 100);
+    proc.Thread(100, 102);
+    proc.Start(103, "worker", 100, 102);
+    proc.Start(104, "worker", 103);
+    proc.Start(300, "cl_app", 1);
+    proc.Exit(200);
+    proc.Start(200, "cl_app", 1);
+    Joined joined = tree.Update();
+    std::sort(joined.begin(), joined.end());
+    EXPECT_EQ(joined, (Joined{{101, 1}, {103, 1}, {104, 1}}));
+    EXPECT_EQ(tree.Update(), Joined{});
+
+    std::this_thread::sleep_for(consts::kListingInterval);
+    joined = tree.Update();
+    std::sort(joined.begin(), joined.end());
+    EXPECT_EQ(joined, (Joined{{200, 1}, {300, 1}}));
+
+    // Exited members are dropped, and a reused pid is a new process.
+    proc.Exit(101);
+    tree.Update();
+    proc.Start(101, "other", 1);
+    std::this_thread::sleep_for(consts::kListingInterval);
+    EXPECT_EQ(tree.Update(), Joined{});
+}
+
+TEST(ProcessTree, AdoptedWithoutNames) {
+    FakeProc proc(true);
+    proc.Start(1, "init", 0);
+    proc.Start(100, "cl_app", 1);
+    ProcessTree tree({""}, proc.Root());
+    tree.Adopt(100, 0);
+    EXPECT_EQ(tree.Update(), Joined{});
+    proc.Start(101, "worker", 100);
+    EXPECT_EQ(tree.Update(), (Joined{{101, 0}}));
+}
+
+TEST(ProcessTree, ForgetsRemoved) {
+    FakeProc proc(true);
+    proc.Start(1, "init", 0);
+    proc.Start(100, "cl_app", 1);
+    ProcessTree tree({"cl_app"}, proc.Root());
+    EXPECT_EQ(tree.Update(), (Joined{{100, 0}}));
+
+    // Neither its later children nor its name bring it back, until adopted.
+    tree.Forget(100);
+    proc.Start(101, "worker", 100);
+    EXPECT_EQ(tree.Update(), Joined{});
+    std::this_thread::sleep_for(consts::kListingInterval);
+    EXPECT_EQ(tree.Update(), Joined{});
+    tree.Adopt(100, 0);
+    EXPECT_EQ(tree.Update(), (Joined{{101, 0}}));
+}
+
+TEST(ProcessTree, ListsWithoutChildrenFiles) {
+    FakeProc proc(false);
+    proc.Start(1, "init", 0);
+    proc.Start(100, "cl_app", 1);
+    proc.Start(200, "sh", 1);
+    ProcessTree tree({"cl_app"}, proc.Root());
+    EXPECT_EQ(tree.Update(), (Joined{{100, 0}}));
+
+    proc.Start(101, "worker", 100);
+    EXPECT_EQ(tree.Update(), (Joined{{101, 0}}));
+
+    // Freshly forked processes are looked at again in case they exec.
+    proc.Exit(200);
+    proc.Start(200, "cl_app", 1);
+    EXPECT_EQ(tree.Update(), (Joined{{200, 0}}));
+}
+
+// Runs a group that burns `demand` CPUs while running, plus `leak_secs` of CPU
+// per period that the duty does not account for, such as late stops, through
+// the controller for `periods` periods. Returns the peak windowed usage.
+double Simulate(DutyController& controller, double demand, int periods,
+                double leak_secs = 0.0, double period_secs = 0.1) {
+    double peak = 0.0;
+    for (int i = 0; i < periods; ++i) {
+        double run_secs = controller.Duty() * period_secs;
+        controller.Update(demand * run_secs + leak_secs, run_secs, period_secs);
+        peak = std::max(peak, controller.Usage());
+        EXPECT_GE(controller.Duty(), 0.0);
+        EXPECT_LE(controller.Duty(), 1.0);
+        EXPECT_GE(controller.Budget(), 0.0);
+    }
+    return peak;
+}
+
+TEST(DutyController, ConvergesToLimit) {
+    for (auto [limit, demand] : {std::pair{0.3, 1.0}, {0.05, 1.0}, {0.5, 2.0}, {1.5, 4.0}}) {
+        DutyController controller(limit);
+        Simulate(controller, demand, 100);
+        EXPECT_NEAR(controller.Usage(), limit, 0.01) << limit << " " << demand;
+        EXPECT_NEAR(controller.Duty(), limit / demand, 0.01) << limit << " " << demand;
+    }
+}
+
+TEST(DutyController, CorrectsSystematicError) {
+    DutyController controller(0.3);
+    Simulate(controller, 1.0, 200, 0.01);
+    EXPECT_NEAR(controller.Usage(), 0.3, 0.01);
+    EXPECT_LT(controller.Duty(), 0.25);
+}
+
+TEST(DutyController, ClampsDuty) {
+    // A limit above what the group can use lets it run all the time.
+    DutyController unreachable(1.5);
+    Simulate(unreachable, 1.0, 100);
+    EXPECT_EQ(unreachable.Duty(), 1.0);
+    EXPECT_NEAR(unreachable.Usage(), 1.0, 1e-9);
+
+    // Usage the duty cannot bring down stops the group outright.
+    DutyController leaking(0.1);
+    Simulate(leaking, 1.0, 100, 0.05);
+    EXPECT_EQ(leaking.Duty(), 0.0);
+    EXPECT_EQ(leaking.Budget(), 0.0);
+}
+
+// Time spent unthrottled under the limit must not build up credit that lets
+// the group overshoot once it gets busy.
+TEST(DutyController, NoWindupWhileUnderLimit) {
+    DutyController controller(0.5);
+    Simulate(controller, 0.2, 300);
+    EXPECT_EQ(controller.Duty(), 1.0);
+    // Wound up, the window would peak around 0.9; what is left is the demand
+    // estimate catching up with the burst.
+    double peak = Simulate(controller, 1.0, 100);
+    EXPECT_LT(peak, 0.75);
+    EXPECT_NEAR(controller.Usage(), 0.5, 0.01);
+}
+
+TEST(DutyController, SetLimit) {
+    DutyController controller(0.3);
+    Simulate(controller, 1.0, 100);
+    controller.SetLimit(0.6);
+    EXPECT_NEAR(controller.Duty(), 0.6, 0.01);
+    EXPECT_EQ(controller.Usage(), 0.0);
+    Simulate(controller, 1.0, 100);
+    EXPECT_NEAR(controller.Usage(), 0.6, 0.01);
+}
+
+TEST(DutyController, WindowCutsLongPeriodsProRata) {
+    DutyController controller(0.5);
+    controller.Update(0.0, 0.0, 5.0);
+    EXPECT_EQ(controller.Usage(), 0.0);
+    for (int i = 0; i < 5; ++i) {
+        controller.Update(0.1, 0.1, 0.1);
+    }
+    EXPECT_NEAR(controller.Usage(), 0.5, 1e-9);
+    for (int i = 0; i < 5; ++i) {
+        controller.Update(0.1, 0.1, 0.1);
+    }
+    EXPECT_NEAR(controller.Usage(), 1.0, 1e-9);
+}
+
+double ProcessCpuSeconds() {
+    timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Threads of this process that busy-loop on request and otherwise sleep, so
+// that they stay around to be sampled.
+class SpinningThreads {
+public:
+    explicit SpinningThreads(int count) {
+        for (int i = 0; i < count; ++i) {
+            threads_.emplace_back([this] {
+                volatile uint64_t counter = 0;
+                while (!quit_) {
+                    if (spin_) {
+                        counter = counter + 1;
+                    } else {
+                        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                    }
+                }
+            });
+        }
+    }
+
+    ~SpinningThreads() {
+        quit_ = true;
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    void Spin(std::chrono::milliseconds duration) {
+        spin_ = true;
+        std::this_thread::sleep_for(duration);
+        spin_ = false;
+    }
+
+private:
+    std::atomic<bool> spin_ = false;
+    std::atomic<bool> quit_ = false;
+    std::vector<std::thread> threads_;
+};
+
+TEST(ProcessClock, SumsThreads) {
+    ProcessClock clock(getpid());
+    EXPECT_EQ(clock.TakeDiff(), 0);
+    double start = ProcessCpuSeconds();
+    // Started after the baseline, so counted from their start.
+    SpinningThreads threads(4);
+    threads.Spin(std::chrono::milliseconds(300));
+    double used = ProcessCpuSeconds() - start;
+    EXPECT_NEAR(clock.TakeDiff() / 1e9, used, 0.01);
+
+    start = ProcessCpuSeconds();
+    threads.Spin(std::chrono::milliseconds(200));
+    used = ProcessCpuSeconds() - start;
+    EXPECT_NEAR(clock.TakeDiff() / 1e9, used, 0.01);
+}
+
+int CountSchedstatFds() {
+    int count = 0;
+    for (const auto& entry : std::filesystem::directory_iterator("/proc/self/fd")) {
+        std::error_code error;
+        auto target = std::filesystem::read_symlink(entry.path(), error);
+        count += !error && target.filename() == "schedstat";
+    }
+    return count;
+}
+
+// With a low fd limit only some schedstat files stay open. Threads that
+// cannot be opened at first are tried again, and ones that cannot be read at
+// all while fds run out are caught up on the next sample.
+TEST(ProcessClock, ShortOfFds) {
+    EXPECT_EXIT(
+        {
+            struct rlimit limit;
+            getrlimit(RLIMIT_NOFILE, &limit);
+            limit.rlim_cur = 64;
+            setrlimit(RLIMIT_NOFILE, &limit);
+            SpinningThreads threads(40);
+            ProcessClock clock(getpid());
+            std::vector<int> filler;
+            auto exhaust = [&filler] {
+                int fd;
+                while ((fd = dup(STDIN_FILENO)) >= 0) {
+                    filler.push_back(fd);
+                }
+            };
+            auto release = [&filler] {
+                for (int fd : filler) {
+                    close(fd);
+                }
+                filler.clear();
+            };
+
+            exhaust();
+            clock.TakeDiff();
+            release();
+            clock.TakeDiff();
+            int cached = CountSchedstatFds();
+            double start = ProcessCpuSeconds();
+            exhaust();
+            threads.Spin(std::chrono::milliseconds(100));
+            int64_t total = clock.TakeDiff();
+            release();
+            threads.Spin(std::chrono::milliseconds(100));
+            total += clock.TakeDiff();
+            double used = ProcessCpuSeconds() - start;
+
+            std::fprintf(stderr, "cached %d, counted %.3f of %.3f\n", cached, total / 1e9, used);
+            bool ok = cached > 0 && cached <= 32 && std::abs(total / 1e9 - used) < 0.01;
+            std::_Exit(ok ? EXIT_SUCCESS : EXIT_FAILURE);
+        },
+        ::testing::ExitedWithCode(EXIT_SUCCESS), "");
 }
@@ -1,3 +1,1440 @@
-int main() {
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+namespace consts {
+constexpr size_t kAlignment = 16;
+constexpr size_t kMinChunkSize = 32;
+constexpr size_t kMaxSmallChunkSize = 512;
+constexpr size_t kSmallBinCount = (kMaxSmallChunkSize - kMinChunkSize) / kAlignment + 1;
+// Large bins split every power of two from kMaxSmallChunkSize up to the
+// largest size_t into kLargeBinsPerPowerOfTwo ranges.
+constexpr size_t kLargeBinsPerPowerOfTwo = 4;
+constexpr size_t kLargeBinPowers = 64 - 9;
+constexpr size_t kLargeBinCount = kLargeBinsPerPowerOfTwo * kLargeBinPowers;
+constexpr size_t kBinCount = kSmallBinCount + kLargeBinCount;
+constexpr size_t kBinMapWords = (kBinCount + 63) / 64;
+constexpr size_t kMmapThreshold = 128 * 1024;
+constexpr size_t kTopPad = 128 * 1024;
+constexpr size_t kThreadCacheCount = 16;
+constexpr size_t kThreadCacheBatch = 8;
+// Every arena but the main one is a kArenaSize reservation aligned to its
+// size, so a chunk's arena is its address rounded down.
+constexpr size_t kArenaSize = 64 * 1024 * 1024;
+// Mapped arenas are looked up in a bitmap with a bit per kArenaSize of the
+// user address space.
+constexpr size_t kAddressBits = 47;
+constexpr size_t kArenaMapWords = (size_t{1} << kAddressBits) / kArenaSize / 64;
+// How far the main arena's free map reaches; the break heap stops there.
+constexpr size_t kMaxBrkHeapSize = size_t{64} * 1024 * 1024 * 1024;
+constexpr size_t kArenasPerCpu = 8;
+constexpr size_t kMaxArenas = 256;
+constexpr size_t kSpinsBeforeYield = 100;
+constexpr size_t kInUseBit = 0x1;
+constexpr size_t kMmappedBit = 0x2;
+// Set on a chunk waiting in an arena's remote-free queue.
+constexpr size_t kQueuedBit = 0x4;
+constexpr size_t kFlagBits = 0x7;
+}  // namespace consts
+
+namespace errors {
+// Like glibc: report and abort, since the heap can no longer be trusted.
+[[noreturn]] void Abort(const char* message) {
+    write(STDERR_FILENO, message, std::strlen(message));
+    write(STDERR_FILENO, "\n", 1);
+    std::abort();
+}
+}  // namespace errors
+
+// Boundary-tag chunk, laid out like glibc's on 64-bit: prev_size holds the
+// previous chunk's size only while that chunk is free (otherwise it is the
+// tail of its user memory), size carries the flag bits, and fd/bk link a free
+// chunk into its bin. User memory starts at fd, so a chunk of size S serves
+// S - 8 bytes.
+struct Chunk {
+    size_t prev_size;
+    size_t size;
+    Chunk* fd;
+    Chunk* bk;
+
+    size_t Size() const {
+        return size & ~consts::kFlagBits;
+    }
+
+    bool InUse() const {
+        return (size & consts::kInUseBit) != 0;
+    }
+
+    bool Mmapped() const {
+        return (size & consts::kMmappedBit) != 0;
+    }
+
+    bool Queued() const {
+        return (size & consts::kQueuedBit) != 0;
+    }
+
+    Chunk* At(size_t offset) {
+        return reinterpret_cast<Chunk*>(reinterpret_cast<char*>(this) + offset);
+    }
+
+    Chunk* Before(size_t offset) {
+        return reinterpret_cast<Chunk*>(reinterpret_cast<char*>(this) - offset);
+    }
+
+    Chunk* Next() {
+        return At(Size());
+    }
+
+    void* Memory() {
+        return &fd;
+    }
+
+    static Chunk* FromMemory(void* ptr) {
+        return reinterpret_cast<Chunk*>(static_cast<char*>(ptr) - offsetof(Chunk, fd));
+    }
+
+    static size_t ForRequest(size_t bytes) {
+        size_t size = (bytes + sizeof(size_t) + consts::kAlignment - 1) & ~(consts::kAlignment - 1);
+        return size < consts::kMinChunkSize ? consts::kMinChunkSize : size;
+    }
+};
+
+// A free chunk of a large bin. Each bin is a bitwise trie on the chunk size
+// (as in dlmalloc): one node per distinct size, which heads a ring of the
+// other free chunks of that size through fd/bk. The ring members have no
+// parent and no children. The fields sit in memory that a large chunk has
+// to spare.
+struct TreeChunk : Chunk {
+    TreeChunk* child[2];
+    TreeChunk* parent;
+    size_t index;
+};
+
+// Heap operations are short, so a waiter spins for a while first (pausing,
+// to go easy on the sibling hyperthread and the memory bus), then yields
+// the CPU, in case the holder has been preempted and needs it to finish.
+class SpinLock {
+public:
+    void Lock() {
+        for (size_t spins = 0; locked_.exchange(true, std::memory_order_acquire);) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                if (++spins < consts::kSpinsBeforeYield) {
+                    Pause();
+                } else {
+                    sched_yield();
+                }
+            }
+        }
+    }
+
+    bool TryLock() {
+        return !locked_.load(std::memory_order_relaxed) &&
+               !locked_.exchange(true, std::memory_order_acquire);
+    }
+
+    void Unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
+
+private:
+    static void Pause() {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    std::atomic<bool> locked_ = false;
+};
+
+// An arena: one contiguous run of chunks ending in the top chunk, which is
+// carved for requests no bin can serve. The main arena grows with sbrk, the
+// others (see MapArena) inside a reservation of their own. Free chunks sit in
+// doubly linked bins: one per chunk size up to kMaxSmallChunkSize, so a small
+// malloc or free is a list push or pop, then exponentially growing ranges.
+// Neighbours are merged on free. Requests of kMmapThreshold and up get their
+// own mapping. Every arena has its own lock, which the caller holds.
+class Heap {
+public:
+    // A new arena at the start of a fresh kArenaSize reservation, of which
+    // only the pages in use are made accessible. Its free map comes right
+    // after the Heap itself.
+    static Heap* MapArena() {
+        void* mapping = mmap(nullptr, consts::kArenaSize * 2, PROT_NONE,
+                             MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping == MAP_FAILED) {
+            return nullptr;
+        }
+        auto* start = static_cast<char*>(mapping);
+        auto address = reinterpret_cast<uintptr_t>(mapping);
+        size_t lead = ((address + consts::kArenaSize - 1) & ~(consts::kArenaSize - 1)) - address;
+        if (lead != 0) {
+            munmap(start, lead);
+        }
+        munmap(start + lead + consts::kArenaSize, consts::kArenaSize - lead);
+        char* base = start + lead;
+        auto page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        size_t header = (sizeof(Heap) + consts::kAlignment - 1) & ~(consts::kAlignment - 1);
+        size_t map = MapBytes(consts::kArenaSize);
+        size_t length = (header + map + consts::kTopPad + page_size - 1) & ~(page_size - 1);
+        if (mprotect(base, length, PROT_READ | PROT_WRITE) != 0) {
+            munmap(base, consts::kArenaSize);
+            return nullptr;
+        }
+        auto* arena = new (base) Heap;
+        arena->page_size_ = page_size;
+        for (Chunk& bin : arena->bins_) {
+            bin.fd = &bin;
+            bin.bk = &bin;
+        }
+        arena->free_map_ = reinterpret_cast<uint64_t*>(base + header);
+        arena->map_length_ = map;
+        arena->map_reserve_ = map;
+        arena->heap_start_ = reinterpret_cast<Chunk*>(base + header + map);
+        arena->top_ = arena->heap_start_;
+        arena->heap_end_ = base + length;
+        arena->reserve_end_ = base + consts::kArenaSize;
+        return arena;
+    }
+
+    void Lock() {
+        lock_.Lock();
+    }
+
+    bool TryLock() {
+        return lock_.TryLock();
+    }
+
+    void Unlock() {
+        lock_.Unlock();
+    }
+
+    // Whether a request of `bytes` is carved from an arena rather than
+    // mapped on its own.
+    static bool InArena(size_t bytes) {
+        return bytes < consts::kMmapThreshold &&
+               Chunk::ForRequest(bytes) < consts::kMmapThreshold;
+    }
+
+    // What Memalign asks Malloc for, or SIZE_MAX if that would overflow.
+    static size_t ForAlignment(size_t alignment, size_t bytes) {
+        if (alignment <= consts::kAlignment) {
+            return bytes;
+        }
+        if (bytes > PTRDIFF_MAX - alignment - consts::kMinChunkSize * 2) {
+            return SIZE_MAX;
+        }
+        return bytes + alignment + consts::kMinChunkSize;
+    }
+
+    // Without `may_grow` a request the bins and the top cannot serve fails
+    // instead of moving the break, so the caller can return cached chunks
+    // first. An arena request also fails once the arena cannot grow (the
+    // break is blocked, or the reservation is used up); the caller moves on
+    // to another arena then (see ArenaTable::Next).
+    void* Malloc(size_t bytes, bool may_grow = true) {
+        if (bytes > PTRDIFF_MAX - consts::kAlignment * 2) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        size_t size = Chunk::ForRequest(bytes);
+        if (size >= consts::kMmapThreshold) {
+            Init();
+            return MapChunk(size);
+        }
+        Chunk* chunk = TakeChunk(size, may_grow);
+        if (chunk == nullptr) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        return chunk->Memory();
+    }
+
+    // An in-use arena chunk of exactly `size` (below kMmapThreshold).
+    // Chunks freed by other threads are only taken in on a miss.
+    Chunk* TakeChunk(size_t size, bool may_grow) {
+        Init();
+        Chunk* chunk = TakeFromBins(size);
+        if (chunk == nullptr && CollectQueued()) {
+            chunk = TakeFromBins(size);
+        }
+        return chunk != nullptr ? chunk : TakeFromTop(size, may_grow);
+    }
+
+    // Whether `ptr` can be an in-use chunk of this arena, judged without its
+    // lock: anything else must take the checks a locked free makes (see
+    // Checked), which then report it. The heap only grows, so an end read
+    // without the lock is at worst too low for a chunk carved after this
+    // thread last synchronised with the arena; such a chunk cannot have been
+    // handed to it.
+    bool Holds(void* ptr) const {
+        Chunk* chunk = Chunk::FromMemory(ptr);
+        auto* end = __atomic_load_n(&heap_end_, __ATOMIC_RELAXED);
+        if (reinterpret_cast<uintptr_t>(ptr) % consts::kAlignment != 0 || heap_start_ == nullptr ||
+            chunk < heap_start_ || reinterpret_cast<char*>(chunk) >= end ||
+            (chunk->size & consts::kFlagBits) != consts::kInUseBit) {
+            return false;
+        }
+        size_t size = chunk->Size();
+        return size >= consts::kMinChunkSize &&
+               size <= static_cast<size_t>(end - reinterpret_cast<char*>(chunk));
+    }
+
+    // Lets a thread that does not allocate from this arena free `ptr`
+    // without its lock. False unless Holds(ptr).
+    bool Enqueue(void* ptr) {
+        if (!Holds(ptr)) {
+            return false;
+        }
+        Chunk* chunk = Chunk::FromMemory(ptr);
+        chunk->size |= consts::kQueuedBit;
+        Enqueue(chunk, chunk);
+        return true;
+    }
+
+    // Pushes a chain of queued chunks, linked through fd, with a single CAS.
+    void Enqueue(Chunk* first, Chunk* last) {
+        Chunk* head = queued_.load(std::memory_order_relaxed);
+        do {
+            last->fd = head;
+        } while (!queued_.compare_exchange_weak(head, first, std::memory_order_release,
+                                                std::memory_order_relaxed));
+    }
+
+    // Frees everything in the remote-free queue. Taking the whole list at
+    // once under the arena lock makes this the only consumer, so there is
+    // no ABA to worry about.
+    bool CollectQueued() {
+        Chunk* chunk = queued_.exchange(nullptr, std::memory_order_acquire);
+        if (chunk == nullptr) {
+            return false;
+        }
+        while (chunk != nullptr) {
+            Chunk* next = chunk->fd;
+            size_t size = chunk->Size();
+            if (chunk < heap_start_ || size < consts::kMinChunkSize || chunk->At(size) > top_) {
+                errors::Abort("free(): invalid pointer");
+            }
+            Release(chunk);
+            chunk = next;
+        }
+        return true;
+    }
+
+    // Frees an in-use arena chunk, merging it with free neighbours or the top.
+    // The header is marked free first, so that it still reads as free (and a
+    // second free is caught) once it is absorbed into a neighbour.
+    void Release(Chunk* chunk) {
+        size_t size = chunk->Size();
+        chunk->size = size;
+        if (Chunk* prev = FreePrev(chunk)) {
+            Unlink(prev);
+            size += prev->Size();
+            chunk = prev;
+        }
+        Chunk* next = chunk->At(size);
+        if (next == top_) {
+            top_ = chunk;
+            return;
+        }
+        if (!next->InUse()) {
+            Unlink(next);
+            size += next->Size();
+        }
+        MakeFree(chunk, size);
+    }
+
+    void Free(void* ptr) {
+        if (ptr == nullptr) {
+            return;
+        }
+        Chunk* chunk = Checked(ptr, "free(): invalid pointer");
+        if (chunk->Mmapped()) {
+            Unmap(chunk);
+            return;
+        }
+        Release(chunk);
+    }
+
+    void* Realloc(void* ptr, size_t bytes) {
+        if (ptr == nullptr) {
+            return Malloc(bytes);
+        }
+        if (bytes == 0) {
+            Free(ptr);
+            return nullptr;
+        }
+        if (bytes > PTRDIFF_MAX - consts::kAlignment * 2) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        Chunk* chunk = Checked(ptr, "realloc(): invalid pointer");
+        size_t size = Chunk::ForRequest(bytes);
+        if (chunk->Mmapped()) {
+            return RemapChunk(chunk, bytes);
+        }
+        if (Resize(chunk, size)) {
+            return ptr;
+        }
+        if (Chunk* merged = MergeBackward(chunk, size)) {
+            return merged->Memory();
+        }
+        void* moved = Malloc(bytes);
+        if (moved != nullptr) {
+            std::memcpy(moved, ptr, chunk->Size() - sizeof(size_t));
+            Release(chunk);
+        }
+        return moved;
+    }
+
+    // Over-allocates, then gives the misaligned head back as a chunk of its
+    // own (or, for a mapping, records it in prev_size).
+    void* Memalign(size_t alignment, size_t bytes) {
+        if (alignment <= consts::kAlignment) {
+            return Malloc(bytes);
+        }
+        size_t padded = ForAlignment(alignment, bytes);
+        if (padded == SIZE_MAX) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        void* ptr = Malloc(padded);
+        if (ptr == nullptr) {
+            return nullptr;
+        }
+        Chunk* chunk = Chunk::FromMemory(ptr);
+        auto address = reinterpret_cast<uintptr_t>(ptr);
+        uintptr_t aligned = (address + alignment - 1) & ~(alignment - 1);
+        if (aligned != address && aligned - address < consts::kMinChunkSize) {
+            aligned += alignment;
+        }
+        size_t lead = aligned - address;
+        if (lead == 0) {
+            return ptr;
+        }
+        Chunk* result = chunk->At(lead);
+        if (chunk->Mmapped()) {
+            result->prev_size = chunk->prev_size + lead;
+            result->size = (chunk->Size() - lead) | consts::kMmappedBit | consts::kInUseBit;
+            return result->Memory();
+        }
+        result->size = (chunk->Size() - lead) | consts::kInUseBit;
+        chunk->size = lead | consts::kInUseBit;
+        Release(chunk);
+        Resize(result, Chunk::ForRequest(bytes));
+        return result->Memory();
+    }
+
+    size_t UsableSize(void* ptr) {
+        if (ptr == nullptr) {
+            return 0;
+        }
+        Chunk* chunk = Checked(ptr, "malloc_usable_size(): invalid pointer");
+        return chunk->Size() - (chunk->Mmapped() ? offsetof(Chunk, fd) : sizeof(size_t));
+    }
+
+private:
+    void Init() {
+        if (heap_start_ != nullptr) {
+            return;
+        }
+        page_size_ = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+        for (Chunk& bin : bins_) {
+            bin.fd = &bin;
+            bin.bk = &bin;
+        }
+        auto* start = static_cast<char*>(sbrk(0));
+        size_t misalignment = reinterpret_cast<uintptr_t>(start) % consts::kAlignment;
+        if (misalignment != 0) {
+            sbrk(static_cast<intptr_t>(consts::kAlignment - misalignment));
+            start += consts::kAlignment - misalignment;
+        }
+        heap_start_ = reinterpret_cast<Chunk*>(start);
+        top_ = heap_start_;
+        heap_end_ = start;
+        // Reserved whole but made accessible as the heap grows (see MapUpTo).
+        // Without it the break heap cannot grow and requests go to mmap.
+        size_t map = MapBytes(consts::kMaxBrkHeapSize);
+        void* mapping =
+            mmap(nullptr, map, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (mapping != MAP_FAILED) {
+            free_map_ = static_cast<uint64_t*>(mapping);
+            map_reserve_ = map;
+        }
+    }
+
+    // Free map bytes for a heap of `size` bytes: a bit per kAlignment bytes.
+    static constexpr size_t MapBytes(size_t size) {
+        return size / consts::kAlignment / 8;
+    }
+
+    // Makes the free map reach the heap up to `end`, or returns false if it
+    // cannot.
+    bool MapUpTo(const char* end) {
+        auto heap_size = static_cast<size_t>(end - reinterpret_cast<char*>(heap_start_));
+        size_t needed = MapBytes(heap_size) + sizeof(uint64_t);
+        needed = (needed + page_size_ - 1) & ~(page_size_ - 1);
+        if (needed <= map_length_) {
+            return true;
+        }
+        if (needed > map_reserve_) {
+            return false;
+        }
+        if (mprotect(reinterpret_cast<char*>(free_map_) + map_length_, needed - map_length_,
+                     PROT_READ | PROT_WRITE) != 0) {
+            return false;
+        }
+        map_length_ = needed;
+        return true;
+    }
+
+    size_t Granule(const Chunk* chunk) const {
+        return static_cast<size_t>(reinterpret_cast<const char*>(chunk) -
+                                   reinterpret_cast<const char*>(heap_start_)) /
+               consts::kAlignment;
+    }
+
+    bool IsFree(const Chunk* chunk) const {
+        size_t granule = Granule(chunk);
+        return (free_map_[granule / 64] >> (granule % 64) & 1) != 0;
+    }
+
+    static size_t BinIndex(size_t size) {
+        if (size <= consts::kMaxSmallChunkSize) {
+            return (size - consts::kMinChunkSize) / consts::kAlignment;
+        }
+        size_t power = 63 - __builtin_clzll(size);
+        size_t quarter = (size >> (power - 2)) & (consts::kLargeBinsPerPowerOfTwo - 1);
+        size_t index = consts::kSmallBinCount +
+                       (power - 9) * consts::kLargeBinsPerPowerOfTwo + quarter;
+        return index;
+    }
+
+    // Size bits below the ones BinIndex looked at decide the way down a
+    // large bin's trie, highest first; this shifts the first of them to the
+    // top.
+    static size_t TrieShift(size_t index) {
+        size_t power = 9 + (index - consts::kSmallBinCount) / consts::kLargeBinsPerPowerOfTwo;
+        return 63 - (power - 3);
+    }
+
+    void Mark(size_t index) {
+        bin_map_[index / 64] |= uint64_t{1} << (index % 64);
+    }
+
+    void Unmark(size_t index) {
+        bin_map_[index / 64] &= ~(uint64_t{1} << (index % 64));
+    }
+
+    // The first non-empty bin from `index` on, or kBinCount.
+    size_t NextNonEmpty(size_t index) const {
+        for (size_t word = index / 64; word < consts::kBinMapWords; ++word) {
+            uint64_t bits = bin_map_[word];
+            if (word == index / 64) {
+                bits &= ~uint64_t{0} << (index % 64);
+            }
+            if (bits != 0) {
+                return word * 64 + __builtin_ctzll(bits);
+            }
+        }
+        return consts::kBinCount;
+    }
+
+    void Link(Chunk* chunk) {
+        size_t granule = Granule(chunk);
+        free_map_[granule / 64] |= uint64_t{1} << (granule % 64);
+        size_t index = BinIndex(chunk->Size());
+        Mark(index);
+        if (index >= consts::kSmallBinCount) {
+            Insert(static_cast<TreeChunk*>(chunk), index);
+            return;
+        }
+        Chunk* bin = &bins_[index];
+        chunk->fd = bin->fd;
+        chunk->bk = bin;
+        bin->fd->bk = chunk;
+        bin->fd = chunk;
+    }
+
+    void Unlink(Chunk* chunk) {
+        if (chunk->fd->bk != chunk || chunk->bk->fd != chunk) {
+            errors::Abort("corrupted double-linked list");
+        }
+        size_t granule = Granule(chunk);
+        free_map_[granule / 64] &= ~(uint64_t{1} << (granule % 64));
+        if (chunk->Size() > consts::kMaxSmallChunkSize) {
+            Remove(static_cast<TreeChunk*>(chunk));
+            return;
+        }
+        chunk->fd->bk = chunk->bk;
+        chunk->bk->fd = chunk->fd;
+        if (chunk->fd == chunk->bk) {
+            Unmark(static_cast<size_t>(chunk->fd - bins_));
+        }
+    }
+
+    void Insert(TreeChunk* chunk, size_t index) {
+        TreeChunk*& root = trees_[index - consts::kSmallBinCount];
+        chunk->child[0] = nullptr;
+        chunk->child[1] = nullptr;
+        chunk->index = index;
+        chunk->fd = chunk;
+        chunk->bk = chunk;
+        if (root == nullptr) {
+            root = chunk;
+            chunk->parent = nullptr;
+            return;
+        }
+        size_t size = chunk->Size();
+        size_t bits = size << TrieShift(index);
+        for (TreeChunk* node = root;; bits <<= 1) {
+            if (node->Size() == size) {
+                // Joins the ring behind the node.
+                chunk->parent = nullptr;
+                chunk->fd = node->fd;
+                chunk->bk = node;
+                node->fd->bk = chunk;
+                node->fd = chunk;
+                return;
+            }
+            TreeChunk*& next = node->child[bits >> 63];
+            if (next == nullptr) {
+                next = chunk;
+                chunk->parent = node;
+                return;
+            }
+            node = next;
+        }
+    }
+
+    // A node leaves the trie for the next chunk of its ring or, if it was
+    // alone, for its deepest descendant (any leaf keeps the trie ordered).
+    void Remove(TreeChunk* chunk) {
+        TreeChunk*& root = trees_[chunk->index - consts::kSmallBinCount];
+        TreeChunk* replacement = nullptr;
+        if (chunk->bk != chunk) {
+            replacement = static_cast<TreeChunk*>(chunk->bk);
+            chunk->fd->bk = chunk->bk;
+            chunk->bk->fd = chunk->fd;
+            if (chunk->parent == nullptr && root != chunk) {
+                return;
+            }
+        } else {
+            TreeChunk** slot = &chunk->child[chunk->child[1] != nullptr ? 1 : 0];
+            replacement = *slot;
+            if (replacement != nullptr) {
+                while (replacement->child[0] != nullptr || replacement->child[1] != nullptr) {
+                    slot = &replacement->child[replacement->child[1] != nullptr ? 1 : 0];
+                    replacement = *slot;
+                }
+                *slot = nullptr;
+            }
+        }
+        if (root == chunk) {
+            root = replacement;
+            if (replacement == nullptr) {
+                Unmark(chunk->index);
+            }
+        } else {
+            TreeChunk* parent = chunk->parent;
+            parent->child[parent->child[0] == chunk ? 0 : 1] = replacement;
+        }
+        if (replacement != nullptr) {
+            replacement->parent = chunk->parent;
+            for (size_t side = 0; side < 2; ++side) {
+                replacement->child[side] = chunk->child[side];
+                if (chunk->child[side] != nullptr) {
+                    chunk->child[side]->parent = replacement;
+                }
+            }
+        }
+    }
+
+    // A free chunk of exactly `size`, preferring a ring member, whose
+    // removal leaves the trie alone.
+    Chunk* FindExact(size_t size) {
+        size_t index = BinIndex(size);
+        if (index < consts::kSmallBinCount) {
+            Chunk* bin = &bins_[index];
+            return bin->fd != bin ? bin->fd : nullptr;
+        }
+        size_t bits = size << TrieShift(index);
+        for (TreeChunk* node = trees_[index - consts::kSmallBinCount]; node != nullptr;
+             bits <<= 1) {
+            if (node->Size() == size) {
+                return node->fd;
+            }
+            node = node->child[bits >> 63];
+        }
+        return nullptr;
+    }
+
+    // The smallest chunk of at least `size` in the trie of bin `index`, or
+    // nullptr. Walks down the path of `size`, remembering the last right
+    // subtree it passed by (everything there is bigger), then the leftmost
+    // path of that subtree, where its smallest chunk lies.
+    TreeChunk* BestFit(size_t index, size_t size) {
+        TreeChunk* best = nullptr;
+        // Sizes below `size` wrap around to above this.
+        size_t best_rest = -size;
+        TreeChunk* bigger = nullptr;
+        size_t bits = size << TrieShift(index);
+        for (TreeChunk* node = trees_[index - consts::kSmallBinCount]; node != nullptr;
+             bits <<= 1) {
+            size_t rest = node->Size() - size;
+            if (rest < best_rest) {
+                best = node;
+                best_rest = rest;
+                if (rest == 0) {
+                    return best;
+                }
+            }
+            TreeChunk* right = node->child[1];
+            node = node->child[bits >> 63];
+            if (right != nullptr && right != node) {
+                bigger = right;
+            }
+        }
+        TreeChunk* smallest = Smallest(bigger);
+        return smallest != nullptr && smallest->Size() - size < best_rest ? smallest : best;
+    }
+
+    static TreeChunk* Smallest(TreeChunk* node) {
+        TreeChunk* smallest = node;
+        for (; node != nullptr; node = node->child[node->child[0] != nullptr ? 0 : 1]) {
+            if (node->Size() < smallest->Size()) {
+                smallest = node;
+            }
+        }
+        return smallest;
+    }
+
+    // Marks a free chunk of `size` at `chunk` and files it in its bin; the
+    // footer in the next chunk's prev_size is what lets that chunk find it.
+    void MakeFree(Chunk* chunk, size_t size) {
+        chunk->size = size;
+        chunk->Next()->prev_size = size;
+        Link(chunk);
+    }
+
+    // Cuts `chunk` down to `size` and frees the rest when it is big enough to
+    // be a chunk. The rest can only border an allocated chunk or the top.
+    void Split(Chunk* chunk, size_t size) {
+        size_t rest = chunk->Size() - size;
+        if (rest < consts::kMinChunkSize) {
+            return;
+        }
+        chunk->size = size | consts::kInUseBit;
+        Chunk* tail = chunk->At(size);
+        tail->size = rest | consts::kInUseBit;
+        Release(tail);
+    }
+
+    // Best fit that keeps chunk sizes exact: a chunk of exactly `size`, or
+    // else the smallest one that leaves a remainder big enough to split off.
+    // The bin bitmap finds the next non-empty bin with a few word operations
+    // and the large bins are tries, so neither step depends on how many
+    // chunks are free.
+    Chunk* TakeFromBins(size_t size) {
+        Chunk* chunk = FindExact(size);
+        if (chunk == nullptr) {
+            size_t wanted = size + consts::kMinChunkSize;
+            size_t index = BinIndex(wanted);
+            if (index >= consts::kSmallBinCount) {
+                chunk = BestFit(index, wanted);
+                ++index;
+            }
+            if (chunk == nullptr) {
+                // Anything in a later bin is big enough.
+                index = NextNonEmpty(index);
+                if (index == consts::kBinCount) {
+                    return nullptr;
+                }
+                chunk = index < consts::kSmallBinCount
+                            ? bins_[index].fd
+                            : Smallest(trees_[index - consts::kSmallBinCount]);
+            }
+            // A chunk from the node's ring, if it has one, spares the trie.
+            chunk = chunk->fd->Size() == chunk->Size() ? chunk->fd : chunk;
+        }
+        Unlink(chunk);
+        chunk->size |= consts::kInUseBit;
+        Split(chunk, size);
+        return chunk;
+    }
+
+    Chunk* TakeFromTop(size_t size, bool may_grow) {
+        // The top always keeps room for a header, so it can be fenced off if
+        // the break ever jumps.
+        if (TopSize() < size + consts::kMinChunkSize && (!may_grow || !GrowTop(size))) {
+            return nullptr;
+        }
+        Chunk* chunk = top_;
+        chunk->size = size | consts::kInUseBit;
+        top_ = chunk->At(size);
+        return chunk;
+    }
+
+    size_t TopSize() const {
+        return static_cast<size_t>(heap_end_ - reinterpret_cast<char*>(top_));
+    }
+
+    // Grows by what is missing plus kTopPad, so a run of small requests
+    // costs one sbrk (or mprotect) per kTopPad bytes.
+    bool GrowTop(size_t size) {
+        size_t missing = size + consts::kMinChunkSize - TopSize();
+        size_t increment = (missing + consts::kTopPad + page_size_ - 1) & ~(page_size_ - 1);
+        if (reserve_end_ != nullptr) {
+            auto left = static_cast<size_t>(reserve_end_ - heap_end_);
+            if (left < missing) {
+                return false;
+            }
+            increment = increment < left ? increment : left;
+            if (mprotect(heap_end_, increment, PROT_READ | PROT_WRITE) != 0) {
+                return false;
+            }
+            heap_end_ += increment;
+            return true;
+        }
+        if (!MapUpTo(heap_end_ + increment)) {
+            return false;
+        }
+        void* old_end = sbrk(static_cast<intptr_t>(increment));
+        if (old_end == reinterpret_cast<void*>(-1)) {
+            return false;
+        }
+        if (old_end == heap_end_) {
+            heap_end_ += increment;
+            return true;
+        }
+        if (!MapUpTo(static_cast<char*>(old_end) + increment)) {
+            sbrk(-static_cast<intptr_t>(increment));
+            return false;
+        }
+        // Someone else moved the break: fence off the old top (it keeps room
+        // for one header) and continue from the new memory.
+        size_t old_top = TopSize();
+        top_->size = old_top | consts::kInUseBit;
+        if (old_top >= 2 * consts::kMinChunkSize) {
+            top_->size = (old_top - consts::kMinChunkSize) | consts::kInUseBit;
+            top_->Next()->size = consts::kMinChunkSize | consts::kInUseBit;
+            Release(top_);
+        }
+        auto* start = static_cast<char*>(old_end);
+        size_t misalignment = reinterpret_cast<uintptr_t>(start) % consts::kAlignment;
+        size_t skip = misalignment == 0 ? 0 : consts::kAlignment - misalignment;
+        top_ = reinterpret_cast<Chunk*>(start + skip);
+        heap_end_ = start + increment;
+        return TopSize() >= size + consts::kMinChunkSize || GrowTop(size);
+    }
+
+    // The free chunk right before `chunk`, or nullptr. While that one is in
+    // use prev_size is user data, so where it leads only counts if the free
+    // map has a free chunk starting there that ends at `chunk`.
+    Chunk* FreePrev(Chunk* chunk) {
+        size_t size = chunk->prev_size;
+        auto offset = static_cast<size_t>(reinterpret_cast<char*>(chunk) -
+                                          reinterpret_cast<char*>(heap_start_));
+        if (size < consts::kMinChunkSize || size % consts::kAlignment != 0 || size > offset) {
+            return nullptr;
+        }
+        Chunk* prev = chunk->Before(size);
+        return IsFree(prev) && prev->size == size ? prev : nullptr;
+    }
+
+    // Grows into a free or top neighbour when it can; shrinking always works.
+    bool Resize(Chunk* chunk, size_t size) {
+        if (size <= chunk->Size()) {
+            Split(chunk, size);
+            return true;
+        }
+        Chunk* next = chunk->Next();
+        size_t missing = size - chunk->Size();
+        if (next == top_) {
+            if (TopSize() < missing + consts::kMinChunkSize && !GrowTop(missing)) {
+                return false;
+            }
+            if (next != top_) {
+                return false;
+            }
+            chunk->size = size | consts::kInUseBit;
+            top_ = chunk->At(size);
+            return true;
+        }
+        if (next->InUse() || next->Size() < missing) {
+            return false;
+        }
+        Unlink(next);
+        chunk->size = (chunk->Size() + next->Size()) | consts::kInUseBit;
+        Split(chunk, size);
+        return true;
+    }
+
+    // Moves the chunk's contents down into a free predecessor when the two
+    // (and a free successor) are big enough together.
+    Chunk* MergeBackward(Chunk* chunk, size_t size) {
+        Chunk* prev = FreePrev(chunk);
+        if (prev == nullptr) {
+            return nullptr;
+        }
+        Chunk* next = chunk->Next();
+        bool take_next = next != top_ && !next->InUse();
+        size_t total = prev->Size() + chunk->Size() + (take_next ? next->Size() : 0);
+        if (total < size) {
+            return nullptr;
+        }
+        Unlink(prev);
+        if (take_next) {
+            Unlink(next);
+        }
+        std::memmove(prev->Memory(), chunk->Memory(), chunk->Size() - sizeof(size_t));
+        prev->size = total | consts::kInUseBit;
+        Split(prev, size);
+        return prev;
+    }
+
+    // The chunk behind a pointer handed out earlier, or an abort.
+    Chunk* Checked(void* ptr, const char* message) {
+        Init();
+        auto address = reinterpret_cast<uintptr_t>(ptr);
+        if (address % consts::kAlignment != 0) {
+            errors::Abort(message);
+        }
+        Chunk* chunk = Chunk::FromMemory(ptr);
+        if (heap_start_ != nullptr && chunk >= heap_start_ &&
+            reinterpret_cast<char*>(chunk) < heap_end_) {
+            if (!chunk->InUse() || chunk->Queued()) {
+                errors::Abort("double free detected");
+            }
+            size_t size = chunk->Size();
+            if (chunk->Mmapped() || size < consts::kMinChunkSize || chunk->At(size) > top_) {
+                errors::Abort(message);
+            }
+            return chunk;
+        }
+        auto mapping = reinterpret_cast<uintptr_t>(chunk) - chunk->prev_size;
+        if (!chunk->Mmapped() || !chunk->InUse() || page_size_ == 0 || mapping % page_size_ != 0 ||
+            (chunk->prev_size + chunk->Size()) % page_size_ != 0) {
+            errors::Abort(message);
+        }
+        return chunk;
+    }
+
+    void* MapChunk(size_t size) {
+        Init();
+        size_t length = (size + sizeof(size_t) + page_size_ - 1) & ~(page_size_ - 1);
+        void* mapping =
+            mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED) {
+            errno = ENOMEM;
+            return nullptr;
+        }
+        auto* chunk = static_cast<Chunk*>(mapping);
+        chunk->prev_size = 0;
+        chunk->size = length | consts::kMmappedBit | consts::kInUseBit;
+        return chunk->Memory();
+    }
+
+    // prev_size of a mapped chunk is its offset into the mapping (non-zero
+    // only after Memalign).
+    void Unmap(Chunk* chunk) {
+        munmap(chunk->Before(chunk->prev_size), chunk->prev_size + chunk->Size());
+    }
+
+    void* RemapChunk(Chunk* chunk, size_t bytes) {
+        size_t offset = chunk->prev_size;
+        size_t length = (offset + bytes + offsetof(Chunk, fd) + page_size_ - 1) & ~(page_size_ - 1);
+        size_t old_length = offset + chunk->Size();
+        if (length == old_length) {
+            return chunk->Memory();
+        }
+        void* mapping = mremap(chunk->Before(offset), old_length, length, MREMAP_MAYMOVE);
+        if (mapping == MAP_FAILED) {
+            if (length < old_length) {
+                return chunk->Memory();
+            }
+            void* moved = Malloc(bytes);
+            if (moved != nullptr) {
+                std::memcpy(moved, chunk->Memory(), chunk->Size() - offsetof(Chunk, fd));
+                Unmap(chunk);
+            }
+            return moved;
+        }
+        chunk = static_cast<Chunk*>(mapping)->At(offset);
+        chunk->size = (length - offset) | consts::kMmappedBit | consts::kInUseBit;
+        return chunk->Memory();
+    }
+
+    Chunk bins_[consts::kSmallBinCount] = {};
+    TreeChunk* trees_[consts::kLargeBinCount] = {};
+    uint64_t bin_map_[consts::kBinMapWords] = {};
+    // A bit per kAlignment bytes from heap_start_ on, set where a free chunk
+    // starts, so telling a free chunk from an in-use one never rests on a
+    // header that may be user data. Pages of it become accessible as the
+    // heap grows: map_length_ bytes out of map_reserve_.
+    uint64_t* free_map_ = nullptr;
+    size_t map_length_ = 0;
+    size_t map_reserve_ = 0;
+    Chunk* heap_start_ = nullptr;
+    Chunk* top_ = nullptr;
+    char* heap_end_ = nullptr;
+    // End of the reservation of a mapped arena; nullptr for the brk one.
+    char* reserve_end_ = nullptr;
+    size_t page_size_ = 0;
+    SpinLock lock_;
+    std::atomic<Chunk*> queued_ = nullptr;
+};
+
+// The main arena. Constant-initialised, so it works before any constructor
+// has run.
+constinit Heap heap;
+
+// The mapped arenas in creation order, and a bit set for each in a map of
+// the address space. Both are only ever added to, so Owner can read them
+// without the lock.
+class ArenaTable {
+public:
+    // The arena `ptr` was carved from; anything outside the mapped arenas
+    // (including bad pointers) is left to the main one to sort out.
+    Heap& Owner(void* ptr) {
+        size_t index = reinterpret_cast<uintptr_t>(ptr) / consts::kArenaSize;
+        if (index / 64 < consts::kArenaMapWords &&
+            ((map_[index / 64].load(std::memory_order_acquire) >> (index % 64)) & 1) != 0) {
+            return *reinterpret_cast<Heap*>(index * consts::kArenaSize);
+        }
+        return heap;
+    }
+
+    // Where to move a thread that found `current` locked: a new arena while
+    // there are fewer than kArenasPerCpu per CPU, the next one in turn after.
+    // A thread whose arena is `used_up` gets a new one while any slot is
+    // left, since the others may well be full too.
+    Heap* Next(Heap* current, bool used_up = false) {
+        lock_.Lock();
+        if (limit_ == 0) {
+            long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+            limit_ = consts::kArenasPerCpu * static_cast<size_t>(cpus > 0 ? cpus : 1);
+            limit_ = limit_ < consts::kMaxArenas ? limit_ : consts::kMaxArenas;
+        }
+        size_t count = count_.load(std::memory_order_relaxed);
+        bool grow = count + 1 < limit_ || (used_up && count < consts::kMaxArenas);
+        Heap* arena = grow ? Heap::MapArena() : nullptr;
+        size_t index = reinterpret_cast<uintptr_t>(arena) / consts::kArenaSize;
+        if (arena != nullptr && index / 64 >= consts::kArenaMapWords) {
+            munmap(arena, consts::kArenaSize);
+            arena = nullptr;
+        }
+        if (arena != nullptr) {
+            arenas_[count] = arena;
+            map_[index / 64].fetch_or(uint64_t{1} << (index % 64), std::memory_order_release);
+            count_.store(count + 1, std::memory_order_release);
+        } else {
+            // Slot `count` stands for the main arena.
+            size_t slot = next_++ % (count + 1);
+            arena = slot == count ? &heap : arenas_[slot];
+            if (arena == current) {
+                slot = next_++ % (count + 1);
+                arena = slot == count ? &heap : arenas_[slot];
+            }
+        }
+        lock_.Unlock();
+        return arena;
+    }
+
+    // Around fork, so the child does not inherit an arena locked by a thread
+    // it no longer has.
+    void LockAll() {
+        lock_.Lock();
+        heap.Lock();
+        for (size_t i = 0; i < count_.load(std::memory_order_relaxed); ++i) {
+            arenas_[i]->Lock();
+        }
+    }
+
+    void UnlockAll() {
+        for (size_t i = 0; i < count_.load(std::memory_order_relaxed); ++i) {
+            arenas_[i]->Unlock();
+        }
+        heap.Unlock();
+        lock_.Unlock();
+    }
+
+private:
+    Heap* arenas_[consts::kMaxArenas] = {};
+    std::atomic<uint64_t> map_[consts::kArenaMapWords] = {};
+    std::atomic<size_t> count_ = 0;
+    size_t limit_ = 0;
+    size_t next_ = 0;
+    SpinLock lock_;
+};
+
+constinit ArenaTable arena_table;
+
+// Every thread starts on the main arena and moves (see ArenaTable::Next)
+// whenever it finds its arena locked by someone else.
+__attribute__((tls_model("initial-exec"))) constinit thread_local Heap* thread_arena = &heap;
+
+// Holds an arena's lock: the calling thread's by default, or the one that
+// owns a given chunk. A thread that moves to another arena frees what was
+// queued there first: the arena may have been left by a thread that exited,
+// and then nothing else would.
+class Guard {
+public:
+    Guard() : arena_(thread_arena) {
+        if (!arena_->TryLock()) {
+            arena_ = arena_table.Next(arena_);
+            thread_arena = arena_;
+            arena_->Lock();
+            arena_->CollectQueued();
+        }
+    }
+
+    explicit Guard(Heap& arena) : arena_(&arena) {
+        arena_->Lock();
+    }
+
+    // Moves the calling thread on from an arena that has run out of room.
+    void MoveOn() {
+        arena_->Unlock();
+        arena_ = arena_table.Next(arena_, true);
+        thread_arena = arena_;
+        arena_->Lock();
+        arena_->CollectQueued();
+    }
+
+    ~Guard() {
+        arena_->Unlock();
+    }
+
+    Heap& Arena() const {
+        return *arena_;
+    }
+
+private:
+    Heap* arena_;
+};
+
+// Per-thread stacks of free chunks, one per small bin. A hit is a push or
+// pop on thread-local memory with no lock or atomic; a miss refills and an
+// overflow flushes kThreadCacheBatch chunks under a single acquisition of
+// an arena lock. Cached chunks keep their in-use bit, so no arena merges
+// them, and their bk points at the owning cache, which is how a second free
+// of the same chunk is caught. A pthread key destructor drains the cache
+// when its thread exits.
+class ThreadCache {
+public:
+    // nullptr while the calling thread's cache is being set up or is gone,
+    // in which case the shared heap serves the thread directly.
+    static ThreadCache* Get();
+
+    static bool Caches(size_t size) {
+        return size <= consts::kMaxSmallChunkSize;
+    }
+
+    Chunk* Pop(size_t size) {
+        size_t index = Index(size);
+        if (heads_[index] == nullptr) {
+            Refill(size);
+        }
+        Chunk* chunk = heads_[index];
+        if (chunk == nullptr) {
+            return nullptr;
+        }
+        heads_[index] = chunk->fd;
+        --counts_[index];
+        chunk->bk = nullptr;
+        return chunk;
+    }
+
+    void Push(Chunk* chunk) {
+        size_t index = Index(chunk->Size());
+        if (chunk->bk == Key()) {
+            for (Chunk* cached = heads_[index]; cached != nullptr; cached = cached->fd) {
+                if (cached == chunk) {
+                    errors::Abort("free(): double free detected in tcache");
+                }
+            }
+        }
+        chunk->fd = heads_[index];
+        chunk->bk = Key();
+        heads_[index] = chunk;
+        if (++counts_[index] > consts::kThreadCacheCount) {
+            Flush(index, consts::kThreadCacheBatch);
+        }
+    }
+
+    // Hands every cached chunk back; no arena lock may be held, since the
+    // chunks can come from any of them.
+    void Drain() {
+        for (size_t index = 0; index < consts::kSmallBinCount; ++index) {
+            Flush(index, counts_[index]);
+        }
+    }
+
+private:
+    enum class State : uint8_t { kNew, kRegistering, kActive, kGone };
+
+    static size_t Index(size_t size) {
+        return (size - consts::kMinChunkSize) / consts::kAlignment;
+    }
+
+    Chunk* Key() {
+        return reinterpret_cast<Chunk*>(this);
+    }
+
+    // Returns `count` chunks to the arenas they came from, one run of
+    // chunks with the same owner at a time: a run from this thread's arena
+    // is released under one lock, any other is queued with one CAS.
+    void Flush(size_t index, size_t count) {
+        while (count > 0) {
+            Chunk* first = heads_[index];
+            Heap& owner = arena_table.Owner(first->Memory());
+            Chunk* last = first;
+            size_t run = 1;
+            while (run < count && &arena_table.Owner(last->fd->Memory()) == &owner) {
+                last = last->fd;
+                ++run;
+            }
+            heads_[index] = last->fd;
+            counts_[index] -= run;
+            count -= run;
+            if (&owner != thread_arena) {
+                for (Chunk* chunk = first; chunk != last; chunk = chunk->fd) {
+                    chunk->size |= consts::kQueuedBit;
+                }
+                last->size |= consts::kQueuedBit;
+                owner.Enqueue(first, last);
+                continue;
+            }
+            Guard guard(owner);
+            for (Chunk* chunk = first; run > 0; --run) {
+                Chunk* next = chunk->fd;
+                owner.Release(chunk);
+                chunk = next;
+            }
+        }
+    }
+
+    // Only grows the arena once this cache has been drained, since its
+    // chunks may be what the arena is short of.
+    void Refill(size_t size) {
+        size_t index = Index(size);
+        {
+            Guard guard;
+            while (counts_[index] < consts::kThreadCacheBatch) {
+                Chunk* chunk = guard.Arena().TakeChunk(size, false);
+                if (chunk == nullptr) {
+                    break;
+                }
+                chunk->fd = heads_[index];
+                heads_[index] = chunk;
+                ++counts_[index];
+            }
+        }
+        if (heads_[index] != nullptr) {
+            return;
+        }
+        Drain();
+        Guard guard;
+        Chunk* chunk = guard.Arena().TakeChunk(size, true);
+        if (chunk != nullptr) {
+            chunk->fd = nullptr;
+            heads_[index] = chunk;
+            counts_[index] = 1;
+        }
+    }
+
+    static void OnThreadExit(void* arg) {
+        auto* cache = static_cast<ThreadCache*>(arg);
+        cache->state_ = State::kGone;
+        cache->Drain();
+    }
+
+    Chunk* heads_[consts::kSmallBinCount] = {};
+    uint8_t counts_[consts::kSmallBinCount] = {};
+    State state_ = State::kNew;
+};
+
+// initial-exec keeps every access a plain TLS load: the general model may
+// call __tls_get_addr, which can allocate.
+__attribute__((tls_model("initial-exec"))) constinit thread_local ThreadCache thread_cache;
+pthread_key_t thread_cache_key;
+pthread_once_t thread_cache_once = PTHREAD_ONCE_INIT;
+
+ThreadCache* ThreadCache::Get() {
+    ThreadCache* cache = &thread_cache;
+    if (cache->state_ == State::kActive) {
+        return cache;
+    }
+    if (cache->state_ != State::kNew) {
+        return nullptr;
+    }
+    // Both calls below may allocate; until they return this thread bypasses
+    // its cache.
+    cache->state_ = State::kRegistering;
+    pthread_once(&thread_cache_once, [] {
+        pthread_key_create(&thread_cache_key, OnThreadExit);
+        // A child forked while another thread held the lock would never see
+        // it released.
+        pthread_atfork([] { arena_table.LockAll(); }, [] { arena_table.UnlockAll(); },
+                       [] { arena_table.UnlockAll(); });
+    });
+    pthread_setspecific(thread_cache_key, cache);
+    cache->state_ = State::kActive;
+    return cache;
+}
+
+// Runs `allocate` on the calling thread's arena and, for a request that
+// arenas serve, on one after another (see Guard::MoveOn) while it fails.
+template <typename Function>
+void* FromArenas(bool in_arena, Function allocate) {
+    Guard guard;
+    for (size_t moves = 0;; ++moves) {
+        void* ptr = allocate(guard.Arena());
+        if (ptr != nullptr || !in_arena || moves > consts::kMaxArenas) {
+            return ptr;
+        }
+        guard.MoveOn();
+    }
+}
+
+// malloc and calloc share this: inside calloc a call to malloc itself
+// would let the compiler treat the result as a fresh object and flag the
+// read of the chunk header in front of it as out of bounds.
+void* Allocate(size_t size) {
+    ThreadCache* cache = ThreadCache::Get();
+    // The first check keeps ForRequest clear of overflow.
+    // A cache that cannot be refilled (its arena is used up) falls through
+    // to another arena.
+    if (cache != nullptr && size <= consts::kMaxSmallChunkSize &&
+        ThreadCache::Caches(Chunk::ForRequest(size))) {
+        if (Chunk* chunk = cache->Pop(Chunk::ForRequest(size))) {
+            return chunk->Memory();
+        }
+    }
+    if (cache != nullptr) {
+        {
+            Guard guard;
+            if (void* ptr = guard.Arena().Malloc(size, false)) {
+                return ptr;
+            }
+        }
+        cache->Drain();
+    }
+    return FromArenas(Heap::InArena(size), [size](Heap& arena) { return arena.Malloc(size); });
+}
+
+extern "C" {
+void* malloc(size_t size) {
+    return Allocate(size);
+}
+
+void free(void* ptr) {
+    if (ptr == nullptr) {
+        return;
+    }
+    // Only what lies in its arena's heap and looks like a live small chunk is
+    // cached, since a cached chunk is later released without further checks;
+    // anything else takes the checked path.
+    Heap& owner = arena_table.Owner(ptr);
+    if (owner.Holds(ptr) && ThreadCache::Caches(Chunk::FromMemory(ptr)->Size())) {
+        if (ThreadCache* cache = ThreadCache::Get()) {
+            cache->Push(Chunk::FromMemory(ptr));
+            return;
+        }
+    }
+    // A chunk of another thread's arena is queued rather than freed under
+    // that arena's lock.
+    if (&owner != thread_arena && owner.Enqueue(ptr)) {
+        return;
+    }
+    Guard guard(owner);
+    owner.Free(ptr);
+}
+
+void* calloc(size_t count, size_t size) {
+    size_t bytes;
+    if (__builtin_mul_overflow(count, size, &bytes)) {
+        errno = ENOMEM;
+        return nullptr;
+    }
+    void* ptr = Allocate(bytes);
+    // Fresh mappings are already zero.
+    if (ptr != nullptr && !Chunk::FromMemory(ptr)->Mmapped()) {
+        std::memset(ptr, 0, bytes);
+    }
+    return ptr;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == nullptr) {
+        return malloc(size);
+    }
+    Heap& owner = arena_table.Owner(ptr);
+    size_t usable;
+    {
+        Guard guard(owner);
+        void* result = owner.Realloc(ptr, size);
+        if (result != nullptr || size == 0 || !Heap::InArena(size)) {
+            return result;
+        }
+        usable = owner.UsableSize(ptr);
+    }
+    // The block's arena is used up: move it to one that is not.
+    void* moved = Allocate(size);
+    if (moved != nullptr) {
+        std::memcpy(moved, ptr, usable);
+        free(ptr);
+    }
+    return moved;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return nullptr;
+    }
+    return FromArenas(Heap::InArena(Heap::ForAlignment(alignment, size)),
+                      [=](Heap& arena) { return arena.Memalign(alignment, size); });
+}
+
+int posix_memalign(void** result, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* ptr = memalign(alignment, size);
+    if (ptr == nullptr) {
+        return ENOMEM;
+    }
+    *result = ptr;
     return 0;
 }
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+void* valloc(size_t size) {
+    return memalign(static_cast<size_t>(sysconf(_SC_PAGESIZE)), size);
+}
+
+void* pvalloc(size_t size) {
+    auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+size_t malloc_usable_size(void* ptr) {
+    Guard guard(arena_table.Owner(ptr));
+    return guard.Arena().UsableSize(ptr);
+}
+}
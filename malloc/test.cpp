@@ -47,6 +47,18 @@
 #define TEST10_PATH "./test_malloc10"
 #endif
 
+#ifndef TEST11_PATH
+#define TEST11_PATH "./test_malloc11"
+#endif
+
+#ifndef TEST12_PATH
+#define TEST12_PATH "./test_malloc12"
+#endif
+
+#ifndef TEST13_PATH
+#define TEST13_PATH "./test_malloc13"
+#endif
+
 TEST(RunMalloc, TheOneAndOnly) {
     std::string cmd1 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST1_PATH;
     std::string cmd2 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST2_PATH;
@@ -58,6 +70,9 @@ TEST(RunMalloc, TheOneAndOnly) {
     std::string cmd8 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST8_PATH;
     std::string cmd9 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST9_PATH;
     std::string cmd10 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST10_PATH;
+    std::string cmd11 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST11_PATH;
+    std::string cmd12 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST12_PATH;
+    std::string cmd13 = std::string("LD_PRELOAD=") + LIB_PATH + " " + TEST13_PATH;
 
     EXPECT_EQ(system(cmd1.c_str()), 0);
     EXPECT_EQ(system(cmd2.c_str()), 0);
@@ -69,4 +84,7 @@ TEST(RunMalloc, TheOneAndOnly) {
     EXPECT_EQ(system(cmd8.c_str()), 0);
     EXPECT_EQ(system(cmd9.c_str()), 0);
     EXPECT_EQ(system(cmd10.c_str()), 0);
+    EXPECT_EQ(system(cmd11.c_str()), 0);
+    EXPECT_EQ(system(cmd12.c_str()), 0);
+    EXPECT_EQ(system(cmd13.c_str()), 0);
 }
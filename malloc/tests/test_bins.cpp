@@ -0,0 +1,233 @@
+#include <algorithm>
+#include <cstdint>
+#include <random>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <gtest/gtest.h>
+#include <sys/mman.h>
+
+// Frees a list of blocks chained through their first word.
+void FreeChain(void* chain) {
+    while (chain != nullptr) {
+        void* next = *static_cast<void**>(chain);
+        free(chain);
+        chain = next;
+    }
+}
+
+// Runs `test` on a thread of a fresh mapped arena, so that no free chunk
+// left over by anything else can be a better fit than the ones the test
+// sets up. With the break blocked the main arena runs out, and a thread
+// whose arena has run out is given a new one. That arena is then grown up
+// front: an arena short of room drains the thread cache first, which would
+// leave the cached chunks as free holes among the test's blocks. Blocks are
+// chained through themselves, since any other allocation in the new arena
+// would keep them from merging back into its top.
+template <typename Test>
+void InOwnArena(Test test) {
+    std::thread([&test] {
+        auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+        auto end = (reinterpret_cast<uintptr_t>(sbrk(0)) + page - 1) & ~(page - 1);
+        void* wall = mmap(reinterpret_cast<void*>(end), page, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+        ASSERT_EQ(wall, reinterpret_cast<void*>(end));
+        void* chain = nullptr;
+        void* block;
+        while ((block = malloc(1000)) < wall) {
+            *static_cast<void**>(block) = chain;
+            chain = block;
+        }
+        void* grown = nullptr;
+        for (size_t i = 0; i < 64; ++i) {
+            *static_cast<void**>(block) = grown;
+            grown = block;
+            block = malloc(100000);
+        }
+        free(block);
+        FreeChain(grown);
+        FreeChain(chain);
+        munmap(wall, page);
+        test();
+    }).join();
+}
+
+// Blocks of the given sizes, each followed by a guard block that stays
+// allocated, so that freeing them leaves free chunks of exactly these sizes.
+// Guards are too big for the thread cache, so once they are freed as well
+// everything merges again. Between freeing the blocks and asking for them
+// back the tests allocate nothing else, which could be carved from them.
+class Separated {
+public:
+    explicit Separated(const std::vector<size_t>& sizes) {
+        blocks_.reserve(sizes.size());
+        guards_.reserve(sizes.size());
+        for (size_t size : sizes) {
+            blocks_.push_back(malloc(size));
+            guards_.push_back(malloc(600));
+        }
+    }
+
+    ~Separated() {
+        for (void* guard : guards_) {
+            free(guard);
+        }
+    }
+
+    void* operator[](size_t i) const {
+        return blocks_[i];
+    }
+
+private:
+    std::vector<void*> blocks_;
+    std::vector<void*> guards_;
+};
+
+std::vector<size_t> Shuffled(size_t count, unsigned seed) {
+    std::vector<size_t> order(count);
+    for (size_t i = 0; i < count; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937(seed));
+    return order;
+}
+
+// Many distinct large sizes across several bins, asked for back in random
+// order: every one is an exact fit.
+TEST(MallocTests, BinsDistinctSizes) {
+    InOwnArena([] {
+        std::vector<size_t> sizes(500);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            sizes[i] = 1000 + i * 16;
+        }
+        std::vector<size_t> order = Shuffled(sizes.size(), 42);
+        Separated blocks(sizes);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+        for (size_t i : order) {
+            ASSERT_EQ(malloc(sizes[i]), blocks[i]);
+        }
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+    });
+}
+
+// Free chunks of one size share a trie node; each of them is handed out
+// once, the node itself included.
+TEST(MallocTests, BinsEqualSizes) {
+    InOwnArena([] {
+        std::vector<size_t> sizes(64, 3000);
+        std::vector<void*> taken(sizes.size());
+        Separated blocks(sizes);
+        std::set<void*> freed;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            freed.insert(blocks[i]);
+        }
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+        for (void*& ptr : taken) {
+            ptr = malloc(3000);
+        }
+        for (void* ptr : taken) {
+            ASSERT_EQ(freed.erase(ptr), 1u);
+            free(ptr);
+        }
+    });
+}
+
+// Sizes of one bin freed in shuffled order and taken back in the same
+// order, so each removal takes the root (or some other inner node) out of a
+// trie that still has children below it.
+TEST(MallocTests, BinsInnerNodes) {
+    InOwnArena([] {
+        // One bin: chunk sizes 2048 to 2544.
+        std::vector<size_t> sizes(32);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            sizes[i] = 2040 + i * 16;
+        }
+        for (unsigned seed = 0; seed < 20; ++seed) {
+            std::vector<size_t> order = Shuffled(sizes.size(), seed);
+            Separated blocks(sizes);
+            for (size_t i : order) {
+                free(blocks[i]);
+            }
+            for (size_t i : order) {
+                ASSERT_EQ(malloc(sizes[i]), blocks[i]);
+            }
+            for (size_t i = 0; i < sizes.size(); ++i) {
+                free(blocks[i]);
+            }
+        }
+    });
+}
+
+// Without an exact fit the smallest chunk that still leaves room for a
+// remainder is taken, from the front.
+TEST(MallocTests, BinsBestFit) {
+    InOwnArena([] {
+        // Chunk sizes 3072, 3264, 3136 and 3520, all in one bin.
+        std::vector<size_t> sizes = {3064, 3256, 3128, 3512};
+        Separated blocks(sizes);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+        // A 3088-byte chunk and its remainder need 3120.
+        ASSERT_EQ(malloc(3080), blocks[2]);
+        // 3200 needs 3232.
+        ASSERT_EQ(malloc(3192), blocks[1]);
+        // 3504 needs 3536, more than the 3520 left.
+        void* ptr = malloc(3496);
+        ASSERT_NE(ptr, blocks[3]);
+        free(ptr);
+        // 3008 needs 3040, which falls in the bin below: the smallest chunk
+        // of the next one is the best fit.
+        ASSERT_EQ(malloc(3000), blocks[0]);
+        ASSERT_EQ(malloc(3512), blocks[3]);
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+    });
+}
+
+// A request that nothing in its own bin fits finds the next non-empty bin
+// through the bin bitmap, however far away it is: here a merged chunk bigger
+// than any single arena request, whose bin is past the first bitmap word.
+TEST(MallocTests, BinsBitmapSearch) {
+    InOwnArena([] {
+        std::vector<size_t> sizes(3, 100000);
+        std::vector<void*> run(10);
+        std::vector<void*> taken(sizes.size());
+        Separated blocks(sizes);
+        for (void*& ptr : run) {
+            ptr = malloc(20000);
+        }
+        void* guard = malloc(600);
+        std::set<void*> freed;
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            freed.insert(blocks[i]);
+        }
+        for (void* ptr : run) {
+            free(ptr);
+        }
+        for (size_t i = 0; i < sizes.size(); ++i) {
+            free(blocks[i]);
+        }
+        // The 100000-byte chunks share a bin with the request but are too
+        // small for it; they stay for the exact fits after.
+        ASSERT_EQ(malloc(110000), run[0]);
+        for (void*& ptr : taken) {
+            ptr = malloc(100000);
+        }
+        for (void* ptr : taken) {
+            ASSERT_EQ(freed.erase(ptr), 1u);
+            free(ptr);
+        }
+        free(run[0]);
+        free(guard);
+    });
+}
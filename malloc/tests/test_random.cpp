@@ -0,0 +1,80 @@
+#include <algorithm>
+#include <cstring>
+#include <malloc.h>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+struct Block {
+    unsigned char* ptr = nullptr;
+    size_t size = 0;
+    unsigned char tag = 0;
+};
+
+size_t RandomSize(std::mt19937_64& rng) {
+    int kind = rng() % 100;
+    if (kind < 70) {
+        return rng() % 600;
+    }
+    if (kind < 97) {
+        return rng() % 20000;
+    }
+    return rng() % 300000;
+}
+
+void Fill(Block& block) {
+    std::memset(block.ptr, block.tag, block.size);
+}
+
+bool Intact(const Block& block, size_t size) {
+    for (size_t i = 0; i < size; ++i) {
+        if (block.ptr[i] != block.tag) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Random malloc/realloc/memalign/free traffic over a pool of live blocks, each
+// filled with its own byte, so any overlap or lost copy shows up as a wrong byte.
+TEST(MallocTests, Random) {
+    std::mt19937_64 rng(42);
+    std::vector<Block> blocks(1000);
+    for (int step = 0; step < 200000; ++step) {
+        Block& block = blocks[rng() % blocks.size()];
+        ASSERT_TRUE(block.ptr == nullptr || Intact(block, block.size));
+        int op = rng() % 10;
+        if (op < 4) {
+            free(block.ptr);
+            block.ptr = nullptr;
+        } else if (op < 7) {
+            free(block.ptr);
+            block.size = RandomSize(rng);
+            block.tag = rng();
+            block.ptr = static_cast<unsigned char*>(malloc(block.size));
+            ASSERT_EQ(reinterpret_cast<uintptr_t>(block.ptr) % 16, 0u);
+            Fill(block);
+        } else if (op < 9) {
+            size_t size = RandomSize(rng) + 1;
+            size_t kept = block.ptr == nullptr ? 0 : std::min(size, block.size);
+            block.ptr = static_cast<unsigned char*>(realloc(block.ptr, size));
+            ASSERT_TRUE(Intact(block, kept));
+            block.size = size;
+            Fill(block);
+        } else {
+            free(block.ptr);
+            size_t alignment = size_t(32) << (rng() % 8);
+            block.size = RandomSize(rng);
+            block.tag = rng();
+            block.ptr = static_cast<unsigned char*>(memalign(alignment, block.size));
+            ASSERT_EQ(reinterpret_cast<uintptr_t>(block.ptr) % alignment, 0u);
+            ASSERT_GE(malloc_usable_size(block.ptr), block.size);
+            Fill(block);
+        }
+    }
+    for (Block& block : blocks) {
+        ASSERT_TRUE(block.ptr == nullptr || Intact(block, block.size));
+        free(block.ptr);
+    }
+}
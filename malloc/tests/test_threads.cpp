@@ -0,0 +1,223 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/mman.h>
+
+#include <gtest/gtest.h>
+
+// Small blocks churned on several threads at once, each thread checking that
+// its own blocks keep their contents.
+TEST(MallocTests, ThreadsChurn) {
+    std::vector<std::thread> threads;
+    for (int id = 0; id < 8; ++id) {
+        threads.emplace_back([id] {
+            unsigned char* blocks[64] = {};
+            for (int step = 0; step < 100000; ++step) {
+                int slot = (step * 7 + id) % 64;
+                size_t size = slot * 7 + 1;
+                if (blocks[slot] != nullptr) {
+                    ASSERT_EQ(blocks[slot][0], static_cast<unsigned char>(id));
+                    ASSERT_EQ(blocks[slot][size - 1], static_cast<unsigned char>(id));
+                }
+                free(blocks[slot]);
+                blocks[slot] = static_cast<unsigned char*>(malloc(size));
+                std::memset(blocks[slot], id, size);
+            }
+            for (unsigned char* block : blocks) {
+                free(block);
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+}
+
+// Blocks allocated on one thread and freed on another.
+TEST(MallocTests, ThreadsHandOff) {
+    for (int round = 0; round < 50; ++round) {
+        std::vector<void*> blocks;
+        std::thread producer([&blocks] {
+            for (int i = 0; i < 1000; ++i) {
+                blocks.push_back(malloc(i % 500 + 1));
+            }
+        });
+        producer.join();
+        std::thread consumer([&blocks] {
+            for (void* block : blocks) {
+                free(block);
+            }
+        });
+        consumer.join();
+    }
+}
+
+// Blocks too big for the thread caches, made on competing threads (and so
+// in different arenas), then grown and freed on this one.
+TEST(MallocTests, ThreadsArenas) {
+    std::vector<unsigned char*> blocks(8 * 500);
+    std::vector<std::thread> threads;
+    for (int id = 0; id < 8; ++id) {
+        threads.emplace_back([id, &blocks] {
+            for (int i = 0; i < 500; ++i) {
+                size_t size = 600 + i * 7;
+                auto* block = static_cast<unsigned char*>(malloc(size));
+                std::memset(block, id, size);
+                blocks[id * 500 + i] = block;
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (size_t i = 0; i < blocks.size(); ++i) {
+        unsigned char id = i / 500;
+        size_t size = 600 + i % 500 * 7;
+        auto* block = static_cast<unsigned char*>(realloc(blocks[i], size * 2));
+        ASSERT_EQ(block[0], id);
+        ASSERT_EQ(block[size - 1], id);
+        free(block);
+    }
+}
+
+// Caches of exited threads go back to the heap, so short-lived threads do
+// not make the heap grow without bound.
+TEST(MallocTests, ThreadsExitDrain) {
+    auto spawn = [] {
+        std::thread([] {
+            void* blocks[256];
+            for (int i = 0; i < 256; ++i) {
+                blocks[i] = malloc(i * 2 + 1);
+            }
+            for (void* block : blocks) {
+                free(block);
+            }
+        }).join();
+    };
+    spawn();
+    void* before = sbrk(0);
+    for (int i = 0; i < 1000; ++i) {
+        spawn();
+    }
+    ASSERT_LE(static_cast<char*>(sbrk(0)) - static_cast<char*>(before), 1 << 20);
+}
+
+// Small blocks stay in arenas once the break is blocked and the mapped arena
+// the thread moves to fills up too: none of them gets a mapping of its own.
+TEST(MallocTests, ThreadsArenaUsedUp) {
+    auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto end = (reinterpret_cast<uintptr_t>(sbrk(0)) + page - 1) & ~(page - 1);
+    void* wall = mmap(reinterpret_cast<void*>(end), page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT_EQ(wall, reinterpret_cast<void*>(end));
+    // About 80 MiB, more than a mapped arena holds.
+    std::vector<void*> blocks(200000);
+    for (void*& block : blocks) {
+        block = malloc(400);
+        ASSERT_NE(block, nullptr);
+        size_t size = *reinterpret_cast<size_t*>(static_cast<char*>(block) - sizeof(size_t));
+        ASSERT_EQ(size & 0x2, 0u);
+    }
+    for (void* block : blocks) {
+        free(block);
+    }
+    munmap(wall, page);
+}
+
+// Puts the calling thread on a mapped arena: with the break blocked, the
+// main arena runs out and malloc moves the thread on.
+void LeaveMainArena() {
+    auto page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    auto end = (reinterpret_cast<uintptr_t>(sbrk(0)) + page - 1) & ~(page - 1);
+    void* wall = mmap(reinterpret_cast<void*>(end), page, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    ASSERT_EQ(wall, reinterpret_cast<void*>(end));
+    std::vector<void*> blocks;
+    while (blocks.empty() || blocks.back() < wall) {
+        blocks.push_back(malloc(1000));
+    }
+    for (void* block : blocks) {
+        free(block);
+    }
+    munmap(wall, page);
+}
+
+// Blocks of another thread's arena, freed here without its lock, come back
+// to that arena.
+TEST(MallocTests, ThreadsRemoteFree) {
+    LeaveMainArena();
+    std::vector<void*> blocks;
+    for (int i = 0; i < 2000; ++i) {
+        blocks.push_back(malloc(i % 1500 + 1));
+    }
+    void* last = *std::max_element(blocks.begin(), blocks.end());
+    std::thread([&blocks] {
+        for (void* block : blocks) {
+            free(block);
+        }
+    }).join();
+    size_t reused = 0;
+    for (int i = 0; i < 2000; ++i) {
+        blocks[i] = malloc(i % 1500 + 1);
+        reused += blocks[i] <= last;
+    }
+    ASSERT_GE(reused, 1900u);
+    for (void* block : blocks) {
+        free(block);
+    }
+}
+
+TEST(MallocTests, ThreadsRemoteDoubleFree) {
+    ASSERT_DEATH(
+        {
+            LeaveMainArena();
+            void* ptr = malloc(1000);
+            std::thread([ptr] {
+                free(ptr);
+                free(ptr);
+            }).join();
+        },
+        "double free");
+}
+
+// A bad pointer into another thread's arena is caught by the free that
+// passes it, not later when that arena collects it.
+TEST(MallocTests, ThreadsRemoteInvalidFree) {
+    ASSERT_DEATH(
+        {
+            LeaveMainArena();
+            // What looks like the header of a chunk of size 0.
+            auto* ptr = static_cast<size_t*>(malloc(1000));
+            ptr[1] = 1;
+            auto bad = reinterpret_cast<uintptr_t>(ptr + 2);
+            std::thread([bad] { free(reinterpret_cast<void*>(bad)); }).join();
+        },
+        "invalid pointer");
+}
+
+TEST(MallocTests, ThreadsForgedSmallFree) {
+    ASSERT_DEATH(
+        {
+            // The header of an in-use 48-byte chunk, outside every arena.
+            auto* forged = static_cast<size_t*>(mmap(nullptr, 4096, PROT_READ | PROT_WRITE,
+                                                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+            forged[1] = 48 | 1;
+            auto bad = reinterpret_cast<uintptr_t>(forged + 2);
+            free(reinterpret_cast<void*>(bad));
+        },
+        "invalid pointer");
+}
+
+TEST(MallocTests, ThreadsDoubleFree) {
+    ASSERT_DEATH(
+        {
+            void* ptr = malloc(100);
+            free(ptr);
+            free(ptr);
+        },
+        "double free");
+}
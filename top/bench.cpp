@@ -0,0 +1,163 @@
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fcntl.h>
+#include <signal.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "src/procfs_fixture.h"
+
+#ifndef TOP_PATH
+#define TOP_PATH "./top"
+#endif
+
+namespace consts {
+constexpr int kMeasuredFrames = 4;
+constexpr double kChurnPerAdvance = 0.01;
+constexpr auto kChurnInterval = std::chrono::milliseconds(100);
+}  // namespace consts
+
+struct RunResult {
+    double wall_secs = 0.0;
+    int64_t max_rss_kb = 0;
+    int64_t syscalls = -1;
+};
+
+// Keeps mutating the fixture while top is running so that frames see exits,
+// new pids and CPU deltas instead of a frozen tree.
+class Churner {
+public:
+    explicit Churner(FakeProcfs& procfs) : thread_([this, &procfs] {
+        while (!stop_) {
+            procfs.Advance(consts::kChurnPerAdvance);
+            std::this_thread::sleep_for(consts::kChurnInterval);
+        }
+    }) {
+    }
+
+    ~Churner() {
+        stop_ = true;
+        thread_.join();
+    }
+
+private:
+    std::atomic<bool> stop_ = false;
+    std::thread thread_;
+};
+
+pid_t SpawnTop(const FakeProcfs& procfs, int frames, bool traced) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        std::perror("fork");
+        std::exit(EXIT_FAILURE);
+    }
+    if (pid == 0) {
+        int devnull = open("/dev/null", O_WRONLY);
+        dup2(devnull, STDOUT_FILENO);
+        if (traced) {
+            ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
+        }
+        std::string root = procfs.Root().string();
+        std::string count = std::to_string(frames);
+        execl(TOP_PATH, TOP_PATH, "-b", "-d", "0", "-n", count.c_str(), "--proc-root",
+              root.c_str(), static_cast<char*>(nullptr));
+        _exit(127);
+    }
+    return pid;
+}
+
+RunResult Run(const FakeProcfs& procfs, int frames) {
+    RunResult result;
+    auto start = std::chrono::steady_clock::now();
+    pid_t pid = SpawnTop(procfs, frames, false);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    result.wall_secs =
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    result.max_rss_kb = usage.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        std::fprintf(stderr, "top exited abnormally\n");
+        std::exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+// Counts syscalls with ptrace in a separate run, so tracing overhead does not
+// pollute the timings. Returns -1 if tracing is not permitted here.
+int64_t CountSyscalls(const FakeProcfs& procfs, int frames) {
+    pid_t pid = SpawnTop(procfs, frames, true);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSTOPPED(status) ||
+        ptrace(PTRACE_SETOPTIONS, pid, nullptr, PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL) != 0) {
+        kill(pid, SIGKILL);
+        waitpid(pid, &status, 0);
+        return -1;
+    }
+
+    int64_t stops = 0;
+    int pending_signal = 0;
+    while (true) {
+        ptrace(PTRACE_SYSCALL, pid, nullptr, pending_signal);
+        pending_signal = 0;
+        waitpid(pid, &status, 0);
+        if (WIFEXITED(status) || WIFSIGNALED(status)) {
+            break;
+        }
+        if (WSTOPSIG(status) == (SIGTRAP | 0x80)) {
+            ++stops;
+        } else if (WSTOPSIG(status) != SIGTRAP) {
+            pending_signal = WSTOPSIG(status);
+        }
+    }
+    return stops / 2;
+}
+
+int main(int argc, char** argv) {
+    std::vector<size_t> sizes = {1000, 10000, 100000};
+    if (argc > 1) {
+        sizes.clear();
+        for (int i = 1; i < argc; ++i) {
+            sizes.push_back(std::strtoul(argv[i], nullptr, 10));
+        }
+    }
+
+    std::printf("%8s %12s %16s %12s\n", "PIDS", "FRAME_MS", "SYSCALLS/FRAME", "MAXRSS_KB");
+    for (size_t size : sizes) {
+        FakeProcfs procfs;
+        procfs.Populate(size);
+
+        // Startup and the first (delta-less) frame are measured separately and
+        // subtracted, leaving the steady-state cost of one frame.
+        RunResult base;
+        RunResult full;
+        int64_t base_calls;
+        int64_t full_calls;
+        {
+            Churner churner(procfs);
+            base = Run(procfs, 1);
+            full = Run(procfs, 1 + consts::kMeasuredFrames);
+            base_calls = CountSyscalls(procfs, 1);
+            full_calls = CountSyscalls(procfs, 1 + consts::kMeasuredFrames);
+        }
+
+        double frame_ms = (full.wall_secs - base.wall_secs) * 1000 / consts::kMeasuredFrames;
+        std::string syscalls = "n/a";
+        if (base_calls >= 0 && full_calls >= 0) {
+            syscalls = std::to_string((full_calls - base_calls) / consts::kMeasuredFrames);
+        }
+        std::printf("%8zu %12.2f %16s %12ld\n", size, frame_ms, syscalls.c_str(),
+                    static_cast<long>(full.max_rss_kb));
+        std::fflush(stdout);
+    }
+    return 0;
+}
@@ -1,19 +1,34 @@
 #include <algorithm>
+#include <array>
+#include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <dirent.h>
-#include <fstream>
+#include <fcntl.h>
 #include <iomanip>
 #include <iostream>
 #include <map>
+#include <memory>
+#include <poll.h>
+#include <optional>
 #include <pwd.h>
+#include <regex>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <time.h>
 #include <unistd.h>
 #include <vector>
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
 
 namespace errors {
 void Report(const std::string& context, const std::string& message = "") {
@@ -45,11 +60,48 @@ constexpr int kWidthCpu = 6;
 constexpr int kWidthMem = 6;
 constexpr int kWidthTime = 11;
 constexpr int kWidthCommand = 15;
+constexpr int kWidthTasks = 7;
+constexpr int kWidthSmaps = 10;
+
+constexpr int kMaxLines = 25;
+constexpr int kHeatStripWidth = 64;
+constexpr size_t kSummaryBufferSize = 16 * 1024;
+constexpr size_t kReadChunk = 4096;
+constexpr size_t kDirBufferSize = 32 * 1024;
+constexpr double kMsPerSec = 1000.0;
+constexpr double kUsecPerMs = 1000.0;
+constexpr int kSecsPerHour = 3600;
+constexpr int kSecsPerDay = 86400;
+constexpr int kSmapsRefreshFrames = 5;
 
 constexpr int kPrecisionCpu = 1;
 constexpr int kPrecisionTime = 0;
+
+constexpr double kUsecPerSec = 1e6;
+
+constexpr int kListenBacklog = 16;
+constexpr int kScrapeTimeoutMs = 1000;
+constexpr size_t kMaxScrapeClients = 16;
+constexpr size_t kScrapeRequestLimit = 4096;
 }  // namespace consts
 
+struct CommandInfo {
+    bool headless = false;
+    bool batch = false;
+    int iterations = 0;
+    double delay_secs = 1.0;
+    std::string proc_root = "/proc";
+    bool cgroup_view = false;
+    std::string cgroup_root = "/sys/fs/cgroup";
+    std::string cgroup_pids;
+    bool show_smaps = false;
+    std::vector<int> pids;
+    std::optional<uid_t> uid;
+    std::optional<std::regex> comm_regex;
+    bool show_overhead = false;
+    std::string listen_address;
+};
+
 struct ProcessStat {
     int pid;
     std::string command;
@@ -64,223 +116,1353 @@ struct ProcessStat {
     int virt;
     double cpu;
     double mem;
+    int64_t pss = -1;
+    int64_t uss = -1;
+    int64_t swap = -1;
 };
 
-std::vector<int> GetAllPids() {
-    std::vector<int> pids;
+struct CgroupStat {
+    std::string path;
+    int64_t usage_usec;
+    int64_t memory_bytes;
+    int64_t tasks;
+    double cpu;
+    double mem;
+};
 
-    DIR* dir = opendir("/proc");
-    if (dir == nullptr) {
-        errors::Exit("GetAllPids", "opendir /proc");
+// All file system access goes through the wrappers below, so that --overhead
+// can report what sampling /proc and the cgroup tree costs. The exporter's
+// socket calls and the NSS lookups behind getpwuid(3) are not counted.
+struct IoCounters {
+    int64_t syscalls = 0;
+    int64_t opens = 0;
+    int64_t bytes_read = 0;
+};
+
+IoCounters io_counters;
+
+int CountedOpen(const std::string& path, int flags) {
+    ++io_counters.syscalls;
+    ++io_counters.opens;
+    return open(path.c_str(), flags | O_CLOEXEC);
+}
+
+ssize_t CountedPread(int fd, char* buf, size_t size, off_t offset) {
+    ++io_counters.syscalls;
+    ssize_t got = pread(fd, buf, size, offset);
+    if (got > 0) {
+        io_counters.bytes_read += got;
     }
-    struct dirent* entry;
-    while ((entry = readdir(dir)) != nullptr) {
+    return got;
+}
+
+void CountedClose(int fd) {
+    ++io_counters.syscalls;
+    close(fd);
+}
+
+int CountedStat(const std::string& path, struct stat* st) {
+    ++io_counters.syscalls;
+    return stat(path.c_str(), st);
+}
+
+void CountedWrite(int fd, const std::string& data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ++io_counters.syscalls;
+        ssize_t put = write(fd, data.data() + written, data.size() - written);
+        if (put < 0 && errno == EINTR) {
+            continue;
+        }
+        if (put <= 0) {
+            return;
+        }
+        written += put;
+    }
+}
+
+// procfs returns as much of a file as fits into the buffer, so a short read
+// means the whole file has been read and no extra read(2) for EOF is needed.
+bool ReadFile(const std::string& path, std::string& content) {
+    int fd = CountedOpen(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    content.resize(consts::kReadChunk);
+    size_t size = 0;
+    while (true) {
+        ssize_t got = CountedPread(fd, content.data() + size, content.size() - size, size);
+        if (got < 0) {
+            CountedClose(fd);
+            return false;
+        }
+        size += got;
+        if (size < content.size()) {
+            break;
+        }
+        content.resize(content.size() * 2);
+    }
+    content.resize(size);
+    CountedClose(fd);
+    return true;
+}
+
+// Uses getdents64(2) directly: readdir(3) hides how many syscalls it makes, and
+// a large buffer fetches hundreds of /proc entries per call.
+template <class Callback>
+bool ListDir(const std::string& path, Callback callback) {
+    int fd = CountedOpen(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        return false;
+    }
+    alignas(struct dirent64) char buf[consts::kDirBufferSize];
+    while (true) {
+        ++io_counters.syscalls;
+        int64_t got = syscall(SYS_getdents64, fd, buf, sizeof(buf));
+        if (got <= 0) {
+            break;
+        }
+        for (int64_t pos = 0; pos < got;) {
+            auto* entry = reinterpret_cast<struct dirent64*>(buf + pos);
+            callback(entry->d_name, entry->d_type);
+            pos += entry->d_reclen;
+        }
+    }
+    CountedClose(fd);
+    return true;
+}
+
+std::vector<int> GetAllPids(const std::string& proc_root) {
+    std::vector<int> pids;
+
+    bool listed = ListDir(proc_root, [&pids](const char* name, unsigned char) {
         int pid = 0;
-        if (sscanf(entry->d_name, "%d", &pid) == 1) {
-            std::ifstream test("/proc/" + std::to_string(pid) + "/stat");
-            if (test.is_open()) {
-                pids.push_back(pid);
-            }
+        if (sscanf(name, "%d", &pid) == 1) {
+            pids.push_back(pid);
         }
+    });
+    if (!listed) {
+        errors::Exit("GetAllPids", "open " + proc_root);
     }
-    closedir(dir);
 
     return pids;
 }
 
-void GetProcessStats(int pid, ProcessStat& process) {
-    std::string file_path = "/proc/" + std::to_string(pid) + "/stat";
-    std::ifstream file(file_path);
-    if (!file.is_open()) {
-        errors::Exit("GetProcessStats", "open " + file_path);
+// Processes may exit between readdir and open, so a missing file is not an error.
+// The comm filter is checked right after the stat prefix, before any numeric field.
+bool GetProcessStats(const std::string& proc_root, int pid, ProcessStat& process,
+                     const std::optional<std::regex>& comm_regex = std::nullopt) {
+    std::string file_path = proc_root + "/" + std::to_string(pid) + "/stat";
+    std::string content;
+    if (!ReadFile(file_path, content) || content.empty()) {
+        return false;
+    }
+    std::string line = content.substr(0, content.find('\n'));
+
+    // comm may itself contain spaces and parentheses, so it ends at the last ')'.
+    size_t open = line.find('(');
+    size_t close = line.rfind(')');
+    if (open == std::string::npos || close == std::string::npos || close < open) {
+        return false;
     }
-    for (size_t i = 1; i <= 24; ++i) {
+    process.pid = std::atoi(line.c_str());
+    process.command = line.substr(open + 1, close - open - 1);
+    if (comm_regex && !std::regex_search(process.command, *comm_regex)) {
+        return false;
+    }
+
+    std::istringstream fields(line.substr(close + 1));
+    for (size_t i = 3; i <= 24; ++i) {
         switch (i) {
-            case 1:
-                file >> process.pid;
-                break;
-            case 2: {
-                std::string comm;
-                file >> std::ws;
-                std::getline(file, comm, ')');
-                comm += ')';
-                process.command = comm.substr(1, comm.size() - 2);
-                break;
-            }
             case 3:
-                file >> process.state;
+                fields >> process.state;
                 break;
             case 14:
-                file >> process.utime;
+                fields >> process.utime;
                 break;
             case 15:
-                file >> process.stime;
+                fields >> process.stime;
                 break;
             case 18:
-                file >> process.priority;
+                fields >> process.priority;
                 break;
             case 19:
-                file >> process.niceness;
+                fields >> process.niceness;
                 break;
             case 22: {
-                file >> process.starttime;
+                fields >> process.starttime;
                 break;
             }
             case 23: {
                 int64_t vsize;
-                file >> vsize;
+                fields >> vsize;
                 process.virt = vsize / consts::kKilobyte;
                 break;
             }
             case 24: {
                 int rss;
-                file >> rss;
+                fields >> rss;
                 process.res = rss * sysconf(_SC_PAGESIZE) / consts::kKilobyte;
                 break;
             }
             default: {
                 int64_t skip;
-                file >> skip;
+                fields >> skip;
                 break;
             }
         }
     }
+    return static_cast<bool>(fields);
 }
 
-void GetUsername(int pid, ProcessStat& process) {
-    std::string file_path = "/proc/" + std::to_string(pid) + "/status";
-    std::ifstream file(file_path);
+// The directory of a process is owned by its effective uid, so a uid filter
+// costs a single stat(2) and no file has to be opened.
+bool MatchesUid(const std::string& proc_root, int pid, uid_t uid) {
+    struct stat st;
+    std::string dir_path = proc_root + "/" + std::to_string(pid);
+    return CountedStat(dir_path, &st) == 0 && st.st_uid == uid;
+}
 
-    if (!file.is_open()) {
-        errors::Exit("GetUsername", "open " + file_path);
+const std::string& LookupUsername(uid_t uid) {
+    static std::map<uid_t, std::string> usernames;
+    auto it = usernames.find(uid);
+    if (it == usernames.end()) {
+        struct passwd* passwd = getpwuid(uid);
+        it = usernames.emplace(uid, passwd != nullptr ? passwd->pw_name : std::to_string(uid))
+                 .first;
     }
+    return it->second;
+}
+
+bool GetUsername(const std::string& proc_root, int pid, ProcessStat& process) {
+    std::string file_path = proc_root + "/" + std::to_string(pid) + "/status";
+    std::string content;
+    if (!ReadFile(file_path, content)) {
+        return false;
+    }
+    std::istringstream file(content);
     std::string line;
     while (std::getline(file, line)) {
         if (line.rfind("Uid:", 0) == 0) {
             std::istringstream iss(line.substr(4));
-            int uid;
+            uid_t uid;
             iss >> uid;
-            struct passwd* passwd = getpwuid(uid);
-            if (passwd != nullptr) {
-                process.username = passwd->pw_name;
-            } else {
-                errors::Report("getpwuid", "Failed to get username");
-            }
+            process.username = LookupUsername(uid);
+            return true;
         }
     }
+    return true;
 }
 
-void CalculateCPU(const ProcessStat& prev, ProcessStat& curr) {
+void CalculateCPU(const ProcessStat& prev, ProcessStat& curr, double elapsed_secs) {
+    if (prev.starttime != curr.starttime) {
+        curr.cpu = 0.0;
+        return;
+    }
     int64_t delta = (curr.utime + curr.stime) - (prev.utime + prev.stime);
-    curr.cpu = static_cast<double>(delta) / (consts::kTicksPerSec)*consts::kHundredPercent;
+    curr.cpu = static_cast<double>(delta) / consts::kTicksPerSec / elapsed_secs *
+               consts::kHundredPercent;
 }
 
-double CalculateTotalMem() {
-    int64_t total_memory_kb = 0;
-    std::ifstream meminfo("/proc/meminfo");
-    if (!meminfo.is_open()) {
-        errors::Exit("CalculateTotalMem", "open /proc/meminfo");
+std::string CalculateTime(const ProcessStat& process, double uptime_seconds) {
+    int64_t elapsed_ticks =
+        static_cast<int64_t>(uptime_seconds * consts::kTicksPerSec) - process.starttime;
+    double elapsed_seconds = static_cast<double>(elapsed_ticks) / consts::kTicksPerSec;
+
+    int minutes = static_cast<int>(elapsed_seconds) / consts::kSecsPerMin;
+    double seconds = elapsed_seconds - minutes * consts::kSecsPerMin;
+
+    std::ostringstream oss;
+    oss << minutes << ":" << std::fixed << std::setfill('0') << std::setw(5) << std::setprecision(2)
+        << seconds;
+    return oss.str();
+}
+
+// /proc/stat, /proc/loadavg, /proc/meminfo and /proc/uptime are opened once and
+// re-read every frame with a single pread(2) from offset 0 into a reused buffer,
+// so the header costs four syscalls per frame and no allocations.
+class SystemSummary {
+public:
+    explicit SystemSummary(const std::string& proc_root)
+        : stat_fd_(OpenOrExit(proc_root + "/stat")),
+          loadavg_fd_(OpenOrExit(proc_root + "/loadavg")),
+          meminfo_fd_(OpenOrExit(proc_root + "/meminfo")),
+          uptime_fd_(OpenOrExit(proc_root + "/uptime")),
+          buf_(consts::kSummaryBufferSize) {
+    }
+
+    ~SystemSummary() {
+        CountedClose(stat_fd_);
+        CountedClose(loadavg_fd_);
+        CountedClose(meminfo_fd_);
+        CountedClose(uptime_fd_);
+    }
+
+    SystemSummary(const SystemSummary&) = delete;
+    SystemSummary& operator=(const SystemSummary&) = delete;
+
+    void Sample() {
+        if (ReadFile(uptime_fd_)) {
+            uptime_seconds_ = std::strtod(buf_.data(), nullptr);
+        }
+        if (ReadFile(loadavg_fd_)) {
+            std::sscanf(buf_.data(), "%lf %lf %lf %*d/%d", &load_[0], &load_[1], &load_[2],
+                        &total_tasks_);
+        }
+        if (ReadFile(meminfo_fd_)) {
+            ParseMeminfo();
+        }
+        if (ReadFile(stat_fd_)) {
+            ParseStat();
+        }
+        if (mem_total_kb_ == 0) {
+            errors::Exit("SystemSummary", "Failed to read MemTotal");
+        }
     }
 
+    int64_t MemTotalKb() const {
+        return mem_total_kb_;
+    }
+
+    double UptimeSeconds() const {
+        return uptime_seconds_;
+    }
+
+    // Task counts are shown only when a process scan is available for this frame.
+    // The total is the system's, from /proc/loadavg; a filtered scan covers only
+    // some of the tasks, so it is reported as the number shown rather than by
+    // state.
+    void Print(std::ostream& out, const std::vector<ProcessStat>* processes,
+               bool filtered) const {
+        char line[256];
+        auto uptime = static_cast<int64_t>(uptime_seconds_);
+        std::snprintf(line, sizeof(line),
+                      "top - up %ld days, %2ld:%02ld,  load average: %.2f, %.2f, %.2f\n",
+                      static_cast<long>(uptime / consts::kSecsPerDay),
+                      static_cast<long>(uptime % consts::kSecsPerDay / consts::kSecsPerHour),
+                      static_cast<long>(uptime % consts::kSecsPerHour / consts::kSecsPerMin),
+                      load_[0], load_[1], load_[2]);
+        out << line;
+
+        if (processes != nullptr && filtered) {
+            std::snprintf(line, sizeof(line), "Tasks: %4d total, %4zu shown (filtered)\n",
+                          total_tasks_, processes->size());
+            out << line;
+        } else if (processes != nullptr) {
+            int running = 0;
+            int sleeping = 0;
+            int stopped = 0;
+            int zombie = 0;
+            for (const auto& process : *processes) {
+                switch (process.state) {
+                    case 'R':
+                        ++running;
+                        break;
+                    case 'T':
+                    case 't':
+                        ++stopped;
+                        break;
+                    case 'Z':
+                        ++zombie;
+                        break;
+                    default:
+                        ++sleeping;
+                        break;
+                }
+            }
+            std::snprintf(line, sizeof(line),
+                          "Tasks: %4d total, %4d running, %4d sleeping, %4d stopped, %4d zombie\n",
+                          total_tasks_, running, sleeping, stopped, zombie);
+            out << line;
+        }
+
+        std::array<double, kCpuFields> share = {};
+        uint64_t total_delta = Sum(cpu_now_) - Sum(cpu_prev_);
+        for (size_t i = 0; i < kCpuFields; ++i) {
+            share[i] = total_delta == 0 ? 0.0
+                                        : static_cast<double>(cpu_now_[i] - cpu_prev_[i]) /
+                                              total_delta * consts::kHundredPercent;
+        }
+        std::snprintf(line, sizeof(line),
+                      "%%Cpu(s): %4.1f us, %4.1f sy, %4.1f ni, %4.1f id, %4.1f wa, %4.1f hi, "
+                      "%4.1f si, %4.1f st\n",
+                      share[0], share[2], share[1], share[3], share[4], share[5], share[6],
+                      share[7]);
+        out << line;
+
+        double kb_per_mib = consts::kKilobyte;
+        int64_t cache_kb = buffers_kb_ + cached_kb_ + reclaimable_kb_;
+        std::snprintf(line, sizeof(line),
+                      "MiB Mem : %8.1f total, %8.1f free, %8.1f used, %8.1f buff/cache\n"
+                      "MiB Swap: %8.1f total, %8.1f free, %8.1f used. %8.1f avail Mem\n",
+                      mem_total_kb_ / kb_per_mib, mem_free_kb_ / kb_per_mib,
+                      (mem_total_kb_ - mem_free_kb_ - cache_kb) / kb_per_mib, cache_kb / kb_per_mib,
+                      swap_total_kb_ / kb_per_mib, swap_free_kb_ / kb_per_mib,
+                      (swap_total_kb_ - swap_free_kb_) / kb_per_mib,
+                      mem_available_kb_ / kb_per_mib);
+        out << line;
+
+        // One character per core, kHeatStripWidth cores per line: 256 cores take four lines.
+        static const char kHeat[] = " .:-=+*#%@";
+        constexpr int kLevels = sizeof(kHeat) - 1;
+        for (size_t first = 0; first < core_busy_.size(); first += consts::kHeatStripWidth) {
+            size_t last = std::min(core_busy_.size(), first + consts::kHeatStripWidth);
+            std::string strip;
+            for (size_t core = first; core < last; ++core) {
+                strip += kHeat[std::min(kLevels - 1, static_cast<int>(core_busy_[core] * kLevels))];
+            }
+            std::snprintf(line, sizeof(line), "CPU %3zu [%s]\n", first, strip.c_str());
+            out << line;
+        }
+        out << '\n';
+    }
+
+private:
+    static constexpr size_t kCpuFields = 8;
+    static constexpr size_t kIdle = 3;
+    static constexpr size_t kIowait = 4;
+    using CpuTimes = std::array<uint64_t, kCpuFields>;
+
+    static int OpenOrExit(const std::string& path) {
+        int fd = CountedOpen(path, O_RDONLY);
+        if (fd < 0) {
+            errors::Exit("SystemSummary", "open " + path + ": " + std::strerror(errno));
+        }
+        return fd;
+    }
+
+    static uint64_t Sum(const CpuTimes& times) {
+        uint64_t sum = 0;
+        for (uint64_t value : times) {
+            sum += value;
+        }
+        return sum;
+    }
+
+    bool ReadFile(int fd) {
+        while (true) {
+            ssize_t got = CountedPread(fd, buf_.data(), buf_.size() - 1, 0);
+            if (got < 0) {
+                return false;
+            }
+            if (static_cast<size_t>(got) < buf_.size() - 1) {
+                buf_[got] = '\0';
+                return got > 0;
+            }
+            buf_.resize(buf_.size() * 2);
+        }
+    }
+
+    void ParseMeminfo() {
+        const std::pair<const char*, int64_t*> keys[] = {
+            {"MemTotal:", &mem_total_kb_},       {"MemFree:", &mem_free_kb_},
+            {"MemAvailable:", &mem_available_kb_}, {"Buffers:", &buffers_kb_},
+            {"Cached:", &cached_kb_},            {"SReclaimable:", &reclaimable_kb_},
+            {"SwapTotal:", &swap_total_kb_},     {"SwapFree:", &swap_free_kb_},
+        };
+        for (const char* line = buf_.data(); *line != '\0';) {
+            const char* colon = std::strchr(line, ':');
+            if (colon == nullptr) {
+                break;
+            }
+            for (const auto& [key, value] : keys) {
+                if (std::strncmp(line, key, colon + 1 - line) == 0 &&
+                    key[colon + 1 - line] == '\0') {
+                    *value = std::strtoll(colon + 1, nullptr, 10);
+                }
+            }
+            const char* next = std::strchr(colon, '\n');
+            line = next == nullptr ? colon + std::strlen(colon) : next + 1;
+        }
+    }
+
+    void ParseStat() {
+        size_t cores = 0;
+        for (const char* line = buf_.data(); std::strncmp(line, "cpu", 3) == 0;) {
+            char* cursor = const_cast<char*>(line) + 3;
+            bool aggregate = *cursor == ' ';
+            size_t core = aggregate ? 0 : std::strtoul(cursor, &cursor, 10);
+            CpuTimes times = {};
+            for (size_t i = 0; i < kCpuFields; ++i) {
+                times[i] = std::strtoull(cursor, &cursor, 10);
+            }
+
+            if (aggregate) {
+                cpu_prev_ = cpu_now_;
+                cpu_now_ = times;
+            } else {
+                if (core >= core_now_.size()) {
+                    core_now_.resize(core + 1);
+                    core_busy_.resize(core + 1);
+                }
+                CpuTimes prev = core_now_[core];
+                core_now_[core] = times;
+                uint64_t total = Sum(times) - Sum(prev);
+                uint64_t idle = times[kIdle] + times[kIowait] - prev[kIdle] - prev[kIowait];
+                core_busy_[core] = total == 0 ? 0.0
+                                              : static_cast<double>(total - idle) /
+                                                    static_cast<double>(total);
+                cores = std::max(cores, core + 1);
+            }
+
+            const char* next = std::strchr(cursor, '\n');
+            if (next == nullptr) {
+                break;
+            }
+            line = next + 1;
+        }
+        core_now_.resize(cores);
+        core_busy_.resize(cores);
+    }
+
+    int stat_fd_;
+    int loadavg_fd_;
+    int meminfo_fd_;
+    int uptime_fd_;
+    std::vector<char> buf_;
+
+    double uptime_seconds_ = 0.0;
+    std::array<double, 3> load_ = {};
+    int total_tasks_ = 0;
+    int64_t mem_total_kb_ = 0;
+    int64_t mem_free_kb_ = 0;
+    int64_t mem_available_kb_ = 0;
+    int64_t buffers_kb_ = 0;
+    int64_t cached_kb_ = 0;
+    int64_t reclaimable_kb_ = 0;
+    int64_t swap_total_kb_ = 0;
+    int64_t swap_free_kb_ = 0;
+    CpuTimes cpu_prev_ = {};
+    CpuTimes cpu_now_ = {};
+    std::vector<CpuTimes> core_now_;
+    std::vector<double> core_busy_;
+};
+
+bool ReadFirstNumber(const std::string& file_path, int64_t& value) {
+    std::string content;
+    if (!ReadFile(file_path, content)) {
+        return false;
+    }
+    std::istringstream file(content);
+    return static_cast<bool>(file >> value);
+}
+
+bool GetCgroupStats(const std::string& cgroup_root, const std::string& path, CgroupStat& cgroup) {
+    std::string dir = cgroup_root + path;
+    std::string content;
+    if (!ReadFile(dir + "/cpu.stat", content)) {
+        return false;
+    }
+    std::istringstream cpu_stat(content);
     std::string key;
     int64_t value;
-    while (meminfo >> key >> value) {
-        if (key == "MemTotal:") {
-            total_memory_kb = value;
+    bool found = false;
+    while (cpu_stat >> key >> value) {
+        if (key == "usage_usec") {
+            cgroup.usage_usec = value;
+            found = true;
             break;
         }
     }
-    if (total_memory_kb == 0) {
-        errors::Exit("CalculateTotalMem", "Failed to read MemTotal");
+    if (!found) {
+        return false;
+    }
+
+    // The root cgroup has neither memory.current nor pids.current.
+    cgroup.path = path.empty() ? "/" : path;
+    if (!ReadFirstNumber(dir + "/memory.current", cgroup.memory_bytes)) {
+        cgroup.memory_bytes = 0;
+    }
+    if (!ReadFirstNumber(dir + "/pids.current", cgroup.tasks)) {
+        cgroup.tasks = -1;
     }
-    return total_memory_kb;
+    return true;
 }
 
-std::string CalculateTime(const ProcessStat& process) {
-    std::ifstream file("/proc/uptime");
-    if (!file.is_open()) {
-        errors::Exit("CalculateTime", "open /proc/uptime");
+// Walks the cgroup v2 hierarchy. Its cost depends on the number of cgroups only:
+// usage_usec already accounts for every task, including ones that have exited.
+void GetAllCgroups(const std::string& cgroup_root, const std::string& path,
+                   std::vector<CgroupStat>& cgroups) {
+    CgroupStat cgroup{};
+    if (GetCgroupStats(cgroup_root, path, cgroup)) {
+        cgroups.push_back(cgroup);
     }
 
-    double uptime_seconds;
-    file >> uptime_seconds;
+    std::vector<std::string> children;
+    ListDir(cgroup_root + path, [&](const char* name, unsigned char type) {
+        if (std::strcmp(name, ".") == 0 || std::strcmp(name, "..") == 0) {
+            return;
+        }
+        bool is_dir = type == DT_DIR;
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+            is_dir = CountedStat(cgroup_root + path + "/" + name, &st) == 0 &&
+                     S_ISDIR(st.st_mode);
+        }
+        if (is_dir) {
+            children.emplace_back(name);
+        }
+    });
+    for (const auto& child : children) {
+        GetAllCgroups(cgroup_root, path + "/" + child, cgroups);
+    }
+}
 
-    int64_t elapsed_ticks =
-        static_cast<int64_t>(uptime_seconds * consts::kTicksPerSec) - process.starttime;
-    double elapsed_seconds = static_cast<double>(elapsed_ticks) / consts::kTicksPerSec;
+std::vector<int> GetCgroupPids(const std::string& cgroup_root, const std::string& path) {
+    std::string file_path = cgroup_root + path + "/cgroup.procs";
+    std::string content;
+    if (!ReadFile(file_path, content)) {
+        errors::Exit("GetCgroupPids", "open " + file_path);
+    }
+    std::istringstream file(content);
+    std::vector<int> pids;
+    int pid;
+    while (file >> pid) {
+        pids.push_back(pid);
+    }
+    return pids;
+}
 
-    int minutes = static_cast<int>(elapsed_seconds) / consts::kSecsPerMin;
-    double seconds = elapsed_seconds - minutes * consts::kSecsPerMin;
+void CalculateCgroupCPU(const CgroupStat& prev, CgroupStat& curr, double elapsed_secs) {
+    int64_t delta = curr.usage_usec - prev.usage_usec;
+    curr.cpu = static_cast<double>(delta) / consts::kUsecPerSec / elapsed_secs *
+               consts::kHundredPercent;
+}
 
-    std::ostringstream oss;
-    oss << minutes << ":" << std::fixed << std::setfill('0') << std::setw(5) << std::setprecision(2)
-        << seconds;
-    return oss.str();
+void ClearScreen(std::ostream& out, bool batch) {
+    if (!batch) {
+        out << "\033[H\033[2J\033[3J";
+    }
 }
 
-void PrintTable(const std::vector<ProcessStat>& processes) {
-    std::cout << "\033[H\033[2J\033[3J";
+void PrintCgroupTable(std::ostream& out, const std::vector<CgroupStat>& cgroups) {
+    out << std::left << std::setw(consts::kWidthCpu) << "%CPU"
+        << std::setw(consts::kWidthRes) << "MEM" << std::setw(consts::kWidthMem) << "%MEM"
+        << std::setw(consts::kWidthTasks) << "TASKS"
+        << "CGROUP" << '\n';
+
+    int count = 0;
 
-    std::cout << std::left << std::setw(consts::kWidthPid) << "PID" << std::setw(consts::kWidthUser)
-              << "USER" << std::setw(consts::kWidthPri) << "PR" << std::setw(consts::kWidthNi)
-              << "NI" << std::setw(consts::kWidthVirt) << "VIRT" << std::setw(consts::kWidthRes)
-              << "RES" << std::setw(consts::kWidthStat) << "S" << std::setw(consts::kWidthCpu)
-              << "%CPU" << std::setw(consts::kWidthMem) << "%MEM" << std::setw(consts::kWidthTime)
-              << "TIME+"
-              << "COMMAND" << std::endl;
+    for (const auto& cgroup : cgroups) {
+        if (count++ >= consts::kMaxLines) {
+            break;
+        }
+
+        out << std::left << std::setw(consts::kWidthCpu) << std::fixed
+            << std::setprecision(consts::kPrecisionCpu) << cgroup.cpu
+            << std::setw(consts::kWidthRes) << cgroup.memory_bytes / consts::kKilobyte
+            << std::setw(consts::kWidthMem) << cgroup.mem << std::setw(consts::kWidthTasks)
+            << (cgroup.tasks < 0 ? "-" : std::to_string(cgroup.tasks)) << cgroup.path
+            << '\n';
+    }
+}
+
+bool GetSmapsRollup(const std::string& proc_root, int pid, ProcessStat& process) {
+    std::string content;
+    if (!ReadFile(proc_root + "/" + std::to_string(pid) + "/smaps_rollup", content)) {
+        return false;
+    }
+    std::istringstream file(content);
+    process.pss = process.uss = process.swap = 0;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string key;
+        int64_t value_kb;
+        if (!(iss >> key >> value_kb)) {
+            continue;
+        }
+        if (key == "Pss:") {
+            process.pss = value_kb;
+        } else if (key == "Private_Clean:" || key == "Private_Dirty:") {
+            process.uss += value_kb;
+        } else if (key == "Swap:") {
+            process.swap = value_kb;
+        }
+    }
+    return true;
+}
+
+// smaps_rollup makes the kernel walk every VMA of the process, so it is read only
+// for the rows on screen, and a reading is reused for kSmapsRefreshFrames frames.
+// Entries are keyed by pid and checked against starttime to survive pid reuse.
+class SmapsCache {
+public:
+    void Fill(const std::string& proc_root, std::vector<ProcessStat>& processes, int frame) {
+        size_t visible = std::min(processes.size(), static_cast<size_t>(consts::kMaxLines));
+        for (size_t i = 0; i < visible; ++i) {
+            ProcessStat& process = processes[i];
+            Entry& entry = entries_[process.pid];
+            if (entry.starttime != process.starttime ||
+                frame - entry.sampled_frame >= consts::kSmapsRefreshFrames) {
+                ProcessStat sample{};
+                if (!GetSmapsRollup(proc_root, process.pid, sample)) {
+                    sample.pss = sample.uss = sample.swap = -1;
+                }
+                entry = {process.starttime, frame, sample.pss, sample.uss, sample.swap};
+            }
+            entry.used_frame = frame;
+            process.pss = entry.pss;
+            process.uss = entry.uss;
+            process.swap = entry.swap;
+        }
+
+        std::erase_if(entries_, [frame](const auto& item) {
+            return frame - item.second.used_frame > consts::kSmapsRefreshFrames;
+        });
+    }
+
+private:
+    struct Entry {
+        int64_t starttime = -1;
+        int sampled_frame = 0;
+        int64_t pss = -1;
+        int64_t uss = -1;
+        int64_t swap = -1;
+        int used_frame = 0;
+    };
+
+    std::map<int, Entry> entries_;
+};
+
+std::string FormatKb(int64_t value_kb) {
+    return value_kb < 0 ? "-" : std::to_string(value_kb);
+}
+
+void PrintTable(std::ostream& out, const std::vector<ProcessStat>& processes,
+                double uptime_seconds, bool show_smaps) {
+    out << std::left << std::setw(consts::kWidthPid) << "PID" << std::setw(consts::kWidthUser)
+        << "USER" << std::setw(consts::kWidthPri) << "PR" << std::setw(consts::kWidthNi)
+        << "NI" << std::setw(consts::kWidthVirt) << "VIRT" << std::setw(consts::kWidthRes)
+        << "RES";
+    if (show_smaps) {
+        out << std::setw(consts::kWidthSmaps) << "PSS" << std::setw(consts::kWidthSmaps)
+            << "USS" << std::setw(consts::kWidthSmaps) << "SWAP";
+    }
+    out << std::setw(consts::kWidthStat) << "S" << std::setw(consts::kWidthCpu) << "%CPU"
+        << std::setw(consts::kWidthMem) << "%MEM" << std::setw(consts::kWidthTime) << "TIME+"
+        << "COMMAND" << '\n';
 
-    int max_lines = 25;
     int count = 0;
 
     for (const auto& process : processes) {
-        if (count++ >= max_lines) {
+        if (count++ >= consts::kMaxLines) {
             break;
         }
 
-        std::cout << std::left << std::setw(consts::kWidthPid) << process.pid
-                  << std::setw(consts::kWidthUser)
-                  << process.username.substr(0, consts::kWidthUser - 1)
-                  << std::setw(consts::kWidthPri) << process.priority << std::setw(consts::kWidthNi)
-                  << process.niceness << std::setw(consts::kWidthVirt) << process.virt
-                  << std::setw(consts::kWidthRes) << process.res << std::setw(consts::kWidthStat)
-                  << process.state << std::setw(consts::kWidthCpu) << std::fixed
-                  << std::setprecision(consts::kPrecisionCpu) << process.cpu
-                  << std::setw(consts::kWidthMem) << process.mem << std::setw(consts::kWidthTime)
-                  << std::setprecision(consts::kPrecisionTime) << CalculateTime(process)
-                  << process.command.substr(0, consts::kWidthCommand) << std::endl;
+        out << std::left << std::setw(consts::kWidthPid) << process.pid
+            << std::setw(consts::kWidthUser)
+            << process.username.substr(0, consts::kWidthUser - 1)
+            << std::setw(consts::kWidthPri) << process.priority << std::setw(consts::kWidthNi)
+            << process.niceness << std::setw(consts::kWidthVirt) << process.virt
+            << std::setw(consts::kWidthRes) << process.res;
+        if (show_smaps) {
+            out << std::setw(consts::kWidthSmaps) << FormatKb(process.pss)
+                << std::setw(consts::kWidthSmaps) << FormatKb(process.uss)
+                << std::setw(consts::kWidthSmaps) << FormatKb(process.swap);
+        }
+        out << std::setw(consts::kWidthStat) << process.state
+            << std::setw(consts::kWidthCpu) << std::fixed
+            << std::setprecision(consts::kPrecisionCpu) << process.cpu
+            << std::setw(consts::kWidthMem) << process.mem << std::setw(consts::kWidthTime)
+            << std::setprecision(consts::kPrecisionTime)
+            << CalculateTime(process, uptime_seconds)
+            << process.command.substr(0, consts::kWidthCommand) << '\n';
     }
-
-    std::cout << std::flush;
 }
 
-int main() {
-    std::map<int, ProcessStat> prev_stats;
-    while (true) {
-        std::vector<ProcessStat> processes;
-        std::vector<int> pids = GetAllPids();
-        int64_t total_memory_kb = CalculateTotalMem();
-        for (int pid : pids) {
-            ProcessStat process{};
-            GetProcessStats(pid, process);
-            GetUsername(pid, process);
-
-            if (prev_stats.count(pid) != 0) {
-                CalculateCPU(prev_stats[pid], process);
+// Serves the last published frame in Prometheus text format. Scrapes never
+// touch /proc: the body is rendered once per frame in Publish(). Clients are
+// non-blocking and multiplexed on the frame's poll, so a slow or stalled
+// scraper holds a slot until kScrapeTimeoutMs, never the frame loop.
+class MetricsExporter {
+public:
+    explicit MetricsExporter(const std::string& address) {
+        if (address.rfind("unix:", 0) == 0) {
+            ListenUnix(address.substr(5));
+        } else {
+            ListenTcp(address);
+        }
+    }
+
+    ~MetricsExporter() {
+        for (const Client& client : clients_) {
+            close(client.fd);
+        }
+        close(listen_fd_);
+        if (!unix_path_.empty()) {
+            unlink(unix_path_.c_str());
+        }
+    }
+
+    MetricsExporter(const MetricsExporter&) = delete;
+    MetricsExporter& operator=(const MetricsExporter&) = delete;
+
+    void Publish(const std::vector<ProcessStat>& processes) {
+        struct UserTotals {
+            double cpu = 0.0;
+            int64_t res = 0;
+            std::map<char, int> states;
+        };
+        std::map<std::string, UserTotals> users;
+        std::map<char, int> states;
+        for (const auto& process : processes) {
+            UserTotals& user = users[process.username];
+            user.cpu += process.cpu;
+            user.res += process.res;
+            ++user.states[process.state];
+            ++states[process.state];
+        }
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(consts::kPrecisionCpu);
+
+        out << "# HELP top_process_cpu_percent CPU usage over the last frame.\n"
+            << "# TYPE top_process_cpu_percent gauge\n";
+        for (const auto& process : processes) {
+            out << "top_process_cpu_percent" << ProcessLabels(process) << ' ' << process.cpu
+                << '\n';
+        }
+        out << "# HELP top_process_resident_kilobytes Resident set size.\n"
+            << "# TYPE top_process_resident_kilobytes gauge\n";
+        for (const auto& process : processes) {
+            out << "top_process_resident_kilobytes" << ProcessLabels(process) << ' '
+                << process.res << '\n';
+        }
+
+        out << "# HELP top_user_cpu_percent CPU usage summed over the user's processes.\n"
+            << "# TYPE top_user_cpu_percent gauge\n";
+        for (const auto& [name, user] : users) {
+            out << "top_user_cpu_percent{user=\"" << Escape(name) << "\"} " << user.cpu << '\n';
+        }
+        out << "# HELP top_user_resident_kilobytes Resident set size summed over the user's "
+               "processes.\n"
+            << "# TYPE top_user_resident_kilobytes gauge\n";
+        for (const auto& [name, user] : users) {
+            out << "top_user_resident_kilobytes{user=\"" << Escape(name) << "\"} " << user.res
+                << '\n';
+        }
+        out << "# HELP top_user_processes Number of the user's processes by state.\n"
+            << "# TYPE top_user_processes gauge\n";
+        for (const auto& [name, user] : users) {
+            for (const auto& [state, count] : user.states) {
+                out << "top_user_processes{user=\"" << Escape(name) << "\",state=\"" << state
+                    << "\"} " << count << '\n';
+            }
+        }
+
+        out << "# HELP top_processes Number of processes by state.\n"
+            << "# TYPE top_processes gauge\n";
+        for (const auto& [state, count] : states) {
+            out << "top_processes{state=\"" << state << "\"} " << count << '\n';
+        }
+
+        std::string body = out.str();
+        // Clients still sending the previous frame keep their own copy.
+        response_ = std::make_shared<const std::string>(
+            "HTTP/1.0 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4\r\n"
+            "Content-Length: " +
+            std::to_string(body.size()) + "\r\n\r\n" + body);
+    }
+
+    // Clients that are not done by the deadline carry over to the next call.
+    void ServeUntil(std::chrono::steady_clock::time_point deadline) {
+        std::vector<struct pollfd> pfds;
+        while (true) {
+            auto now = std::chrono::steady_clock::now();
+            std::erase_if(clients_, [now](const Client& client) {
+                if (client.deadline > now) {
+                    return false;
+                }
+                close(client.fd);
+                return true;
+            });
+            if (deadline <= now) {
+                return;
+            }
+            auto wake = deadline;
+            pfds.assign(1, {listen_fd_, POLLIN, 0});
+            for (const Client& client : clients_) {
+                wake = std::min(wake, client.deadline);
+                short events = client.response ? POLLOUT : POLLIN;
+                pfds.push_back({client.fd, events, 0});
+            }
+            auto left = std::chrono::ceil<std::chrono::milliseconds>(wake - now);
+            int ready = poll(pfds.data(), pfds.size(), static_cast<int>(left.count()));
+            if (ready < 0 && errno != EINTR) {
+                errors::Exit("MetricsExporter", std::string("poll: ") + std::strerror(errno));
+            }
+            if (ready <= 0) {
+                continue;
+            }
+            // Backwards, so that erasing keeps the rest in line with pfds.
+            for (size_t i = clients_.size(); i-- > 0;) {
+                if (pfds[i + 1].revents != 0 && !Progress(clients_[i])) {
+                    close(clients_[i].fd);
+                    clients_.erase(clients_.begin() + static_cast<ptrdiff_t>(i));
+                }
+            }
+            if (pfds[0].revents != 0) {
+                Accept();
+            }
+        }
+    }
+
+private:
+    struct Client {
+        int fd;
+        std::string request;
+        // The frame being sent, taken once the request is complete.
+        std::shared_ptr<const std::string> response;
+        size_t sent = 0;
+        std::chrono::steady_clock::time_point deadline;
+    };
+
+    static std::string Escape(const std::string& value) {
+        std::string escaped;
+        for (char c : value) {
+            if (c == '\\' || c == '"') {
+                escaped += '\\';
+                escaped += c;
+            } else if (c == '\n') {
+                escaped += "\\n";
             } else {
-                process.cpu = 0.0;
+                escaped += c;
+            }
+        }
+        return escaped;
+    }
+
+    static std::string ProcessLabels(const ProcessStat& process) {
+        return "{pid=\"" + std::to_string(process.pid) + "\",user=\"" +
+               Escape(process.username) + "\",comm=\"" + Escape(process.command) + "\"}";
+    }
+
+    void ListenUnix(const std::string& path) {
+        struct sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+            errors::Exit("MetricsExporter", "bad unix socket path " + path);
+        }
+        std::strcpy(addr.sun_path, path.c_str());
+        unlink(path.c_str());
+
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (listen_fd_ < 0 ||
+            bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd_, consts::kListenBacklog) != 0) {
+            errors::Exit("MetricsExporter", "listen on " + path + ": " + std::strerror(errno));
+        }
+        unix_path_ = path;
+    }
+
+    void ListenTcp(const std::string& address) {
+        std::string host = "127.0.0.1";
+        std::string port = address;
+        size_t colon = address.rfind(':');
+        if (colon != std::string::npos) {
+            host = address.substr(0, colon);
+            port = address.substr(colon + 1);
+        }
+
+        struct sockaddr_in addr = {};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(static_cast<uint16_t>(std::atoi(port.c_str())));
+        if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1 || addr.sin_port == 0) {
+            errors::Exit("MetricsExporter", "bad listen address " + address);
+        }
+
+        listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int reuse = 1;
+        if (listen_fd_ < 0 ||
+            setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) != 0 ||
+            bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+            listen(listen_fd_, consts::kListenBacklog) != 0) {
+            errors::Exit("MetricsExporter", "listen on " + address + ": " + std::strerror(errno));
+        }
+    }
+
+    void Accept() {
+        int fd;
+        while ((fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+            if (clients_.size() >= consts::kMaxScrapeClients) {
+                close(fd);
+                continue;
+            }
+            auto deadline = std::chrono::steady_clock::now() +
+                            std::chrono::milliseconds(consts::kScrapeTimeoutMs);
+            clients_.push_back({fd, "", nullptr, 0, deadline});
+        }
+    }
+
+    // Moves the client along as far as it goes without blocking. Returns false
+    // once it is done with, served or broken. The request is read and ignored
+    // so that closing the socket does not reset the connection before the
+    // client has seen the response.
+    bool Progress(Client& client) {
+        char buf[512];
+        while (!client.response) {
+            ssize_t got = read(client.fd, buf, sizeof(buf));
+            if (got < 0) {
+                return errno == EAGAIN || errno == EINTR;
+            }
+            client.request.append(buf, got);
+            if (got == 0 || client.request.find("\r\n\r\n") != std::string::npos ||
+                client.request.size() >= consts::kScrapeRequestLimit) {
+                client.response = response_;
             }
-            process.mem =
-                (static_cast<double>(process.res) / total_memory_kb) * consts::kHundredPercent;
-            processes.push_back(process);
-            prev_stats[pid] = process;
         }
+        while (client.sent < client.response->size()) {
+            ssize_t put = send(client.fd, client.response->data() + client.sent,
+                               client.response->size() - client.sent, MSG_NOSIGNAL);
+            if (put < 0) {
+                return errno == EAGAIN || errno == EINTR;
+            }
+            client.sent += put;
+        }
+        return false;
+    }
 
-        std::sort(processes.begin(), processes.end(),
-                  [](auto& first, auto& second) { return first.cpu > second.cpu; });
+    int listen_fd_ = -1;
+    std::string unix_path_;
+    std::shared_ptr<const std::string> response_ = std::make_shared<const std::string>(
+        "HTTP/1.0 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+    std::vector<Client> clients_;
+};
 
-        PrintTable(processes);
+void ExitWithUsage() {
+    std::fprintf(stderr,
+                 "Usage: top [-b] [-n <frames>] [-d <seconds>] [--proc-root <dir>]\n"
+                 "           [--cgroup | --cgroup-pids <cgroup>] [--cgroup-root <dir>]\n"
+                 "           [--smaps] [-u <user>] [-p <pid>[,<pid>...]] [--comm <regex>]\n"
+                 "           [--overhead]\n"
+                 "           [--headless] [--listen unix:<path>|[<host>:]<port>]\n");
+    std::exit(EXIT_FAILURE);
+}
 
-        sleep(1);
+uid_t ParseUser(const std::string& user) {
+    struct passwd* passwd = getpwnam(user.c_str());
+    if (passwd != nullptr) {
+        return passwd->pw_uid;
+    }
+    char* end = nullptr;
+    uint64_t uid = std::strtoul(user.c_str(), &end, 10);
+    if (user.empty() || *end != '\0') {
+        errors::Exit("ParseUser", "unknown user " + user);
+    }
+    return static_cast<uid_t>(uid);
+}
+
+std::vector<int> ParsePidList(const std::string& list) {
+    std::vector<int> pids;
+    std::istringstream iss(list);
+    std::string item;
+    while (std::getline(iss, item, ',')) {
+        int pid = std::atoi(item.c_str());
+        if (pid <= 0) {
+            errors::Exit("ParsePidList", "bad pid " + item);
+        }
+        pids.push_back(pid);
+    }
+    return pids;
+}
+
+CommandInfo ReadArgc(int argc, char** argv) {
+    CommandInfo cmd;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (arg == "--headless") {
+            cmd.headless = true;
+        } else if (arg == "-b") {
+            cmd.batch = true;
+        } else if (arg == "-n" && has_value) {
+            cmd.iterations = std::atoi(argv[++i]);
+            if (cmd.iterations <= 0) {
+                ExitWithUsage();
+            }
+        } else if (arg == "-d" && has_value) {
+            cmd.delay_secs = std::atof(argv[++i]);
+            if (cmd.delay_secs < 0) {
+                ExitWithUsage();
+            }
+        } else if (arg == "--proc-root" && has_value) {
+            cmd.proc_root = argv[++i];
+        } else if (arg == "--cgroup") {
+            cmd.cgroup_view = true;
+        } else if (arg == "--cgroup-pids" && has_value) {
+            cmd.cgroup_pids = argv[++i];
+        } else if (arg == "--cgroup-root" && has_value) {
+            cmd.cgroup_root = argv[++i];
+        } else if (arg == "--overhead") {
+            cmd.show_overhead = true;
+        } else if (arg == "--smaps") {
+            cmd.show_smaps = true;
+        } else if (arg == "-u" && has_value) {
+            cmd.uid = ParseUser(argv[++i]);
+        } else if (arg == "-p" && has_value) {
+            cmd.pids = ParsePidList(argv[++i]);
+        } else if (arg == "--comm" && has_value) {
+            try {
+                cmd.comm_regex.emplace(argv[++i], std::regex::extended | std::regex::nosubs);
+            } catch (const std::regex_error& e) {
+                errors::Exit("ReadArgc", std::string("bad --comm regex: ") + e.what());
+            }
+        } else if (arg == "--listen" && has_value) {
+            cmd.listen_address = argv[++i];
+        } else {
+            ExitWithUsage();
+        }
+    }
+    if (cmd.headless && cmd.listen_address.empty()) {
+        errors::Exit("ReadArgc", "--headless requires --listen");
+    }
+    if (cmd.cgroup_view && (!cmd.cgroup_pids.empty() || !cmd.listen_address.empty())) {
+        errors::Exit("ReadArgc", "--cgroup cannot be combined with --cgroup-pids or --listen");
+    }
+    return cmd;
+}
+
+std::vector<ProcessStat> SampleProcesses(const CommandInfo& cmd,
+                                         std::map<int, ProcessStat>& prev_stats,
+                                         double elapsed_secs, int64_t total_memory_kb) {
+    std::vector<ProcessStat> processes;
+    std::map<int, ProcessStat> curr_stats;
+    std::vector<int> pids;
+    if (!cmd.cgroup_pids.empty()) {
+        pids = GetCgroupPids(cmd.cgroup_root, cmd.cgroup_pids);
+        if (!cmd.pids.empty()) {
+            std::erase_if(pids, [&cmd](int pid) {
+                return std::find(cmd.pids.begin(), cmd.pids.end(), pid) == cmd.pids.end();
+            });
+        }
+    } else if (!cmd.pids.empty()) {
+        pids = cmd.pids;
+    } else {
+        pids = GetAllPids(cmd.proc_root);
+    }
+
+    for (int pid : pids) {
+        if (cmd.uid && !MatchesUid(cmd.proc_root, pid, *cmd.uid)) {
+            continue;
+        }
+        ProcessStat process{};
+        if (!GetProcessStats(cmd.proc_root, pid, process, cmd.comm_regex) ||
+            !GetUsername(cmd.proc_root, pid, process)) {
+            continue;
+        }
+
+        auto prev = prev_stats.find(pid);
+        if (prev != prev_stats.end()) {
+            CalculateCPU(prev->second, process, elapsed_secs);
+        } else {
+            process.cpu = 0.0;
+        }
+        process.mem =
+            (static_cast<double>(process.res) / total_memory_kb) * consts::kHundredPercent;
+        processes.push_back(process);
+        curr_stats[pid] = process;
+    }
+    prev_stats = std::move(curr_stats);
+    return processes;
+}
+
+std::vector<CgroupStat> SampleCgroups(const CommandInfo& cmd,
+                                      std::map<std::string, CgroupStat>& prev_cgroups,
+                                      double elapsed_secs, int64_t total_memory_kb) {
+    std::vector<CgroupStat> cgroups;
+    std::map<std::string, CgroupStat> curr_cgroups;
+    GetAllCgroups(cmd.cgroup_root, "", cgroups);
+    for (auto& cgroup : cgroups) {
+        auto prev = prev_cgroups.find(cgroup.path);
+        if (prev != prev_cgroups.end()) {
+            CalculateCgroupCPU(prev->second, cgroup, elapsed_secs);
+        } else {
+            cgroup.cpu = 0.0;
+        }
+        cgroup.mem = static_cast<double>(cgroup.memory_bytes) / consts::kKilobyte /
+                     total_memory_kb * consts::kHundredPercent;
+        curr_cgroups[cgroup.path] = cgroup;
+    }
+    prev_cgroups = std::move(curr_cgroups);
+    return cgroups;
+}
+
+template <class Stat>
+void SortByCpu(std::vector<Stat>& stats) {
+    std::sort(stats.begin(), stats.end(),
+              [](auto& first, auto& second) { return first.cpu > second.cpu; });
+}
+
+double MsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+}
+
+struct FramePhases {
+    double scan_ms = 0.0;
+    double sort_ms = 0.0;
+    double render_ms = 0.0;
+};
+
+// Reports what top itself costs: time and CPU in full, syscalls and opens for
+// file system access only. Counters are deltas between consecutive reports, so
+// the write(2) that puts a frame on screen is charged to the next one.
+class OverheadMeter {
+public:
+    OverheadMeter() : last_time_(std::chrono::steady_clock::now()), last_cpu_secs_(CpuSecs()) {
+    }
+
+    void Report(std::ostream& out, const FramePhases& phases, bool batch) {
+        auto now = std::chrono::steady_clock::now();
+        double wall_secs = std::chrono::duration<double>(now - last_time_).count();
+        double cpu_secs = CpuSecs();
+        double cpu = wall_secs > 0 ? (cpu_secs - last_cpu_secs_) / wall_secs *
+                                         consts::kHundredPercent
+                                   : 0.0;
+        int64_t rss_kb = ResidentKb();
+        IoCounters delta = {io_counters.syscalls - last_io_.syscalls,
+                            io_counters.opens - last_io_.opens,
+                            io_counters.bytes_read - last_io_.bytes_read};
+        last_time_ = now;
+        last_cpu_secs_ = cpu_secs;
+        last_io_ = io_counters;
+
+        char line[256];
+        if (batch) {
+            std::snprintf(line, sizeof(line),
+                          "STATS scan_ms=%.3f sort_ms=%.3f render_ms=%.3f syscalls=%ld opens=%ld "
+                          "bytes_read=%ld cpu=%.1f rss_kb=%ld\n",
+                          phases.scan_ms, phases.sort_ms, phases.render_ms,
+                          static_cast<long>(delta.syscalls), static_cast<long>(delta.opens),
+                          static_cast<long>(delta.bytes_read), cpu, static_cast<long>(rss_kb));
+        } else {
+            std::snprintf(line, sizeof(line),
+                          "\ntop: scan %.1f ms, sort %.1f ms, render %.1f ms | %ld syscalls, "
+                          "%ld opens, %.1f KiB read | %.1f%% CPU, %ld KiB RSS\n",
+                          phases.scan_ms, phases.sort_ms, phases.render_ms,
+                          static_cast<long>(delta.syscalls), static_cast<long>(delta.opens),
+                          static_cast<double>(delta.bytes_read) / consts::kKilobyte, cpu,
+                          static_cast<long>(rss_kb));
+        }
+        out << line;
+    }
+
+private:
+    static double CpuSecs() {
+        struct rusage usage;
+        ++io_counters.syscalls;
+        getrusage(RUSAGE_SELF, &usage);
+        return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+               (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / consts::kUsecPerSec;
+    }
+
+    // Always the real /proc, even when --proc-root points at a fixture.
+    static int64_t ResidentKb() {
+        std::string content;
+        if (!ReadFile("/proc/self/statm", content)) {
+            return 0;
+        }
+        std::istringstream statm(content);
+        int64_t size_pages = 0;
+        int64_t resident_pages = 0;
+        statm >> size_pages >> resident_pages;
+        return resident_pages * sysconf(_SC_PAGESIZE) / consts::kKilobyte;
+    }
+
+    std::chrono::steady_clock::time_point last_time_;
+    double last_cpu_secs_;
+    IoCounters last_io_ = io_counters;
+};
+
+int main(int argc, char** argv) {
+    CommandInfo cmd = ReadArgc(argc, argv);
+    std::unique_ptr<MetricsExporter> exporter;
+    if (!cmd.listen_address.empty()) {
+        exporter = std::make_unique<MetricsExporter>(cmd.listen_address);
+    }
+
+    std::map<int, ProcessStat> prev_stats;
+    std::map<std::string, CgroupStat> prev_cgroups;
+    SmapsCache smaps_cache;
+    SystemSummary summary(cmd.proc_root);
+    bool filtered = !cmd.pids.empty() || !cmd.cgroup_pids.empty() || cmd.uid.has_value() ||
+                    cmd.comm_regex.has_value();
+    OverheadMeter overhead;
+    auto prev_sample = std::chrono::steady_clock::now();
+    for (int frame = 0; cmd.iterations == 0 || frame < cmd.iterations; ++frame) {
+        auto scan_start = std::chrono::steady_clock::now();
+        auto next_frame =
+            scan_start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                             std::chrono::duration<double>(cmd.delay_secs));
+        FramePhases phases;
+        std::ostringstream out;
+        summary.Sample();
+        int64_t total_memory_kb = summary.MemTotalKb();
+        auto sample = std::chrono::steady_clock::now();
+        double elapsed_secs = std::chrono::duration<double>(sample - prev_sample).count();
+        prev_sample = sample;
+
+        if (cmd.cgroup_view) {
+            std::vector<CgroupStat> cgroups =
+                SampleCgroups(cmd, prev_cgroups, elapsed_secs, total_memory_kb);
+            phases.scan_ms = MsSince(scan_start);
+
+            auto sort_start = std::chrono::steady_clock::now();
+            SortByCpu(cgroups);
+            phases.sort_ms = MsSince(sort_start);
+
+            auto render_start = std::chrono::steady_clock::now();
+            ClearScreen(out, cmd.batch);
+            summary.Print(out, nullptr, false);
+            PrintCgroupTable(out, cgroups);
+            phases.render_ms = MsSince(render_start);
+        } else {
+            std::vector<ProcessStat> processes =
+                SampleProcesses(cmd, prev_stats, elapsed_secs, total_memory_kb);
+            phases.scan_ms = MsSince(scan_start);
+
+            auto sort_start = std::chrono::steady_clock::now();
+            SortByCpu(processes);
+            phases.sort_ms = MsSince(sort_start);
+
+            if (cmd.show_smaps && !cmd.headless) {
+                auto smaps_start = std::chrono::steady_clock::now();
+                smaps_cache.Fill(cmd.proc_root, processes, frame);
+                phases.scan_ms += MsSince(smaps_start);
+            }
+
+            auto render_start = std::chrono::steady_clock::now();
+            if (exporter) {
+                exporter->Publish(processes);
+            }
+            if (!cmd.headless) {
+                ClearScreen(out, cmd.batch);
+                summary.Print(out, &processes, filtered);
+                PrintTable(out, processes, summary.UptimeSeconds(), cmd.show_smaps);
+            }
+            phases.render_ms = MsSince(render_start);
+        }
+
+        if (!cmd.headless) {
+            if (cmd.show_overhead) {
+                overhead.Report(out, phases, cmd.batch);
+            }
+            if (cmd.batch) {
+                out << '\n';
+            }
+            CountedWrite(STDOUT_FILENO, out.str());
+        }
+
+        if (cmd.iterations != 0 && frame + 1 == cmd.iterations) {
+            break;
+        }
+        if (exporter) {
+            exporter->ServeUntil(next_frame);
+        } else {
+            std::this_thread::sleep_until(next_frame);
+        }
     }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,318 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/types.h>
+
+namespace fs = std::filesystem;
+
+inline fs::path MakeTempDir(const std::string& prefix) {
+    std::string tmp = (fs::temp_directory_path() / (prefix + "XXXXXX")).string();
+    if (mkdtemp(tmp.data()) == nullptr) {
+        throw std::runtime_error("Failed to create temp dir");
+    }
+    return tmp;
+}
+
+inline void WriteFile(const fs::path& path, const std::string& content) {
+    std::ofstream out(path, std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error("Failed to open " + path.string());
+    }
+    out << content;
+}
+
+// Replaces the file with rename(2), so a concurrent reader never sees it half-written.
+inline void WriteFileAtomic(const fs::path& path, const std::string& content) {
+    fs::path tmp = path;
+    tmp += ".tmp";
+    {
+        std::ofstream out(tmp);
+        if (!out) {
+            throw std::runtime_error("Failed to open " + tmp.string());
+        }
+        out << content;
+    }
+    fs::rename(tmp, path);
+}
+
+struct FakeProcess {
+    int pid = 0;
+    int ppid = 1;
+    std::string command = "worker";
+    char state = 'S';
+    uid_t uid = 0;
+    int64_t utime = 0;
+    int64_t stime = 0;
+    int64_t priority = 20;
+    int64_t niceness = 0;
+    int64_t starttime = 0;
+    int64_t vsize = 0;
+    int64_t rss_pages = 0;
+    int64_t pss_kb = 0;
+    int64_t uss_kb = 0;
+    int64_t swap_kb = 0;
+    int threads = 1;
+};
+
+// Builds a procfs-shaped tree in a temp dir that top can be pointed at with --proc-root.
+class FakeProcfs {
+public:
+    static constexpr int64_t kTicksPerSec = 100;
+    static constexpr int64_t kMemTotalKb = 16 * 1024 * 1024;
+
+    explicit FakeProcfs(int cpu_count = 4, uint64_t seed = 42)
+        : root_(MakeTempDir("procfs")), rng_(seed), cpu_ticks_(cpu_count) {
+        WriteSystemFiles();
+    }
+
+    ~FakeProcfs() {
+        std::error_code ec;
+        fs::remove_all(root_, ec);
+    }
+
+    FakeProcfs(const FakeProcfs&) = delete;
+    FakeProcfs& operator=(const FakeProcfs&) = delete;
+
+    const fs::path& Root() const {
+        return root_;
+    }
+
+    const std::map<int, FakeProcess>& Processes() const {
+        return processes_;
+    }
+
+    void Add(const FakeProcess& process) {
+        processes_[process.pid] = process;
+        next_pid_ = std::max(next_pid_, process.pid + 1);
+        WriteProcess(process);
+    }
+
+    void Update(const FakeProcess& process) {
+        Add(process);
+    }
+
+    void Remove(int pid) {
+        processes_.erase(pid);
+        fs::remove_all(root_ / std::to_string(pid));
+    }
+
+    // Adds `count` processes with plausible names, owners and memory sizes.
+    void Populate(size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            Add(RandomProcess());
+        }
+    }
+
+    // Simulates one second of activity: a tenth of the processes burn CPU, and
+    // `churn` of them exit and are replaced by freshly spawned ones.
+    void Advance(double churn = 0.01) {
+        uptime_ticks_ += kTicksPerSec;
+        std::uniform_int_distribution<int64_t> load(0, kTicksPerSec);
+        for (auto& cpu : cpu_ticks_) {
+            int64_t busy = load(rng_);
+            cpu.user += busy * 3 / 4;
+            cpu.system += busy - busy * 3 / 4;
+            cpu.idle += kTicksPerSec - busy;
+        }
+        WriteSystemFiles();
+
+        std::vector<int> pids;
+        pids.reserve(processes_.size());
+        for (const auto& [pid, process] : processes_) {
+            pids.push_back(pid);
+        }
+        std::uniform_int_distribution<size_t> pick(0, pids.empty() ? 0 : pids.size() - 1);
+        std::uniform_int_distribution<int64_t> burn(0, kTicksPerSec);
+
+        for (size_t i = 0; i < pids.size() / 10; ++i) {
+            FakeProcess& process = processes_[pids[pick(rng_)]];
+            process.utime += burn(rng_);
+            process.stime += burn(rng_) / 4;
+            process.state = process.state == 'R' ? 'S' : 'R';
+            WriteProcess(process);
+        }
+
+        auto exits = static_cast<size_t>(static_cast<double>(pids.size()) * churn);
+        for (size_t i = 0; i < exits; ++i) {
+            int pid = pids[pick(rng_)];
+            if (processes_.count(pid) != 0) {
+                Remove(pid);
+                Add(RandomProcess());
+            }
+        }
+    }
+
+private:
+    FakeProcess RandomProcess() {
+        static const char* const kCommands[] = {"nginx",    "postgres", "java", "python3",
+                                                "sshd",     "bash",     "node", "kworker/0:1",
+                                                "(sd-pam)", "containerd"};
+        std::uniform_int_distribution<size_t> command(0, std::size(kCommands) - 1);
+        std::uniform_int_distribution<int> owner(0, 3);
+        std::uniform_int_distribution<int64_t> pages(16, 1 << 16);
+
+        FakeProcess process;
+        process.pid = next_pid_;
+        process.ppid = 1;
+        process.command = kCommands[command(rng_)];
+        process.uid = owner(rng_) == 0 ? 0 : getuid();
+        process.starttime = uptime_ticks_;
+        process.rss_pages = pages(rng_);
+        process.vsize = process.rss_pages * 4 * 4096;
+        process.pss_kb = process.rss_pages * 3;
+        process.uss_kb = process.rss_pages * 2;
+        return process;
+    }
+
+    struct CpuTicks {
+        int64_t user = 0;
+        int64_t system = 0;
+        int64_t idle = 0;
+    };
+
+    // top keeps these files open and re-reads them with pread, so unlike the
+    // per-process files they are rewritten in place rather than replaced.
+    void WriteSystemFiles() {
+        double uptime = static_cast<double>(uptime_ticks_) / kTicksPerSec;
+        WriteFile(root_ / "uptime", std::to_string(uptime) + " " + std::to_string(uptime) + "\n");
+        WriteFile(root_ / "meminfo",
+                  "MemTotal:       " + std::to_string(kMemTotalKb) + " kB\nMemFree:        " +
+                      std::to_string(kMemTotalKb / 2) + " kB\nMemAvailable:   " +
+                      std::to_string(kMemTotalKb * 3 / 4) + " kB\nBuffers:        " +
+                      std::to_string(kMemTotalKb / 16) + " kB\nCached:         " +
+                      std::to_string(kMemTotalKb / 8) + " kB\nSwapTotal:      0 kB\n" +
+                      "SwapFree:       0 kB\n");
+        WriteFile(root_ / "loadavg", "0.50 0.40 0.30 1/" + std::to_string(processes_.size()) +
+                                         " " + std::to_string(next_pid_ - 1) + "\n");
+
+        CpuTicks total;
+        std::string cpus;
+        for (size_t i = 0; i < cpu_ticks_.size(); ++i) {
+            const CpuTicks& cpu = cpu_ticks_[i];
+            total.user += cpu.user;
+            total.system += cpu.system;
+            total.idle += cpu.idle;
+            cpus += "cpu" + std::to_string(i) + " " + std::to_string(cpu.user) + " 0 " +
+                    std::to_string(cpu.system) + " " + std::to_string(cpu.idle) +
+                    " 0 0 0 0 0 0\n";
+        }
+        WriteFile(root_ / "stat", "cpu  " + std::to_string(total.user) + " 0 " +
+                                      std::to_string(total.system) + " " +
+                                      std::to_string(total.idle) + " 0 0 0 0 0 0\n" + cpus +
+                                      "intr 0\nctxt 0\nbtime 0\nprocesses " +
+                                      std::to_string(next_pid_) +
+                                      "\nprocs_running 1\nprocs_blocked 0\n");
+    }
+
+    void WriteProcess(const FakeProcess& p) {
+        fs::path dir = root_ / std::to_string(p.pid);
+        fs::create_directories(dir);
+        // Like in procfs, the directory is owned by the process's uid. This only
+        // succeeds for root; otherwise everything stays owned by the caller.
+        chown(dir.c_str(), p.uid, static_cast<gid_t>(-1));
+
+        std::string stat = std::to_string(p.pid) + " (" + p.command + ") " + p.state + " " +
+                           std::to_string(p.ppid) + " " + std::to_string(p.pid) + " " +
+                           std::to_string(p.pid) + " 0 -1 4194560 1200 0 3 0 " +
+                           std::to_string(p.utime) + " " + std::to_string(p.stime) + " 0 0 " +
+                           std::to_string(p.priority) + " " + std::to_string(p.niceness) + " " +
+                           std::to_string(p.threads) + " 0 " + std::to_string(p.starttime) +
+                           " " + std::to_string(p.vsize) + " " + std::to_string(p.rss_pages) +
+                           " 18446744073709551615 1 1 0 0 0 0 0 0 0 0 0 0 17 0 0 0 0 0 0 0 0 0 "
+                           "0 0 0 0 0\n";
+        WriteFileAtomic(dir / "stat", stat);
+
+        std::string uid = std::to_string(p.uid);
+        std::string status = "Name:\t" + p.command + "\nUmask:\t0022\nState:\t" + p.state +
+                             "\nTgid:\t" + std::to_string(p.pid) + "\nPid:\t" +
+                             std::to_string(p.pid) + "\nPPid:\t" + std::to_string(p.ppid) +
+                             "\nTracerPid:\t0\nUid:\t" + uid + "\t" + uid + "\t" + uid + "\t" +
+                             uid + "\nGid:\t" + uid + "\t" + uid + "\t" + uid + "\t" + uid +
+                             "\nVmSize:\t" + std::to_string(p.vsize / 1024) + " kB\nVmRSS:\t" +
+                             std::to_string(p.rss_pages * 4) + " kB\nThreads:\t" +
+                             std::to_string(p.threads) + "\n";
+        WriteFileAtomic(dir / "status", status);
+        WriteFileAtomic(dir / "comm", p.command + "\n");
+
+        int64_t shared_kb = p.rss_pages * 4 - p.uss_kb;
+        std::string smaps = "55d0c0000000-7ffd00000000 ---p 00000000 00:00 0    [rollup]\nRss:   " +
+                            std::to_string(p.rss_pages * 4) + " kB\nPss:   " +
+                            std::to_string(p.pss_kb) + " kB\nShared_Clean:   " +
+                            std::to_string(shared_kb) + " kB\nShared_Dirty:   0 kB\n" +
+                            "Private_Clean:   " + std::to_string(p.uss_kb / 2) +
+                            " kB\nPrivate_Dirty:   " + std::to_string(p.uss_kb - p.uss_kb / 2) +
+                            " kB\nSwap:   " + std::to_string(p.swap_kb) + " kB\nSwapPss:   " +
+                            std::to_string(p.swap_kb) + " kB\n";
+        WriteFileAtomic(dir / "smaps_rollup", smaps);
+    }
+
+    fs::path root_;
+    std::map<int, FakeProcess> processes_;
+    std::mt19937_64 rng_;
+    std::vector<CpuTicks> cpu_ticks_;
+    int next_pid_ = 1;
+    int64_t uptime_ticks_ = 1000 * kTicksPerSec;
+};
+
+struct FakeCgroup {
+    std::string path;
+    int64_t usage_usec = 0;
+    int64_t memory_bytes = 0;
+    std::vector<int> pids;
+};
+
+// A cgroup v2 hierarchy for --cgroup-root; each cgroup gets cpu.stat,
+// memory.current, pids.current and cgroup.procs.
+class FakeCgroupfs {
+public:
+    FakeCgroupfs() : root_(MakeTempDir("cgroupfs")) {
+        WriteFileAtomic(root_ / "cpu.stat", "usage_usec 0\nuser_usec 0\nsystem_usec 0\n");
+    }
+
+    ~FakeCgroupfs() {
+        std::error_code ec;
+        fs::remove_all(root_, ec);
+    }
+
+    FakeCgroupfs(const FakeCgroupfs&) = delete;
+    FakeCgroupfs& operator=(const FakeCgroupfs&) = delete;
+
+    const fs::path& Root() const {
+        return root_;
+    }
+
+    void Write(const FakeCgroup& cgroup) {
+        fs::path dir = root_ / cgroup.path.substr(1);
+        fs::create_directories(dir);
+        for (fs::path parent = dir.parent_path(); parent != root_;
+             parent = parent.parent_path()) {
+            if (!fs::exists(parent / "cpu.stat")) {
+                WriteFileAtomic(parent / "cpu.stat", "usage_usec 0\n");
+            }
+        }
+        WriteFileAtomic(dir / "cpu.stat", "usage_usec " + std::to_string(cgroup.usage_usec) +
+                                              "\nuser_usec " +
+                                              std::to_string(cgroup.usage_usec) +
+                                              "\nsystem_usec 0\n");
+        WriteFileAtomic(dir / "memory.current", std::to_string(cgroup.memory_bytes) + "\n");
+        WriteFileAtomic(dir / "pids.current", std::to_string(cgroup.pids.size()) + "\n");
+        std::string procs;
+        for (int pid : cgroup.pids) {
+            procs += std::to_string(pid) + "\n";
+        }
+        WriteFileAtomic(dir / "cgroup.procs", procs);
+    }
+
+private:
+    fs::path root_;
+};
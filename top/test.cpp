@@ -1,4 +1,476 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
 #include <gtest/gtest.h>
 
-TEST(NotYetReady, NotYetReady) {
+#include "src/procfs_fixture.h"
+
+#ifndef TOP_PATH
+#define TOP_PATH "./top"
+#endif
+
+using Row = std::vector<std::string>;
+
+class TopProcess {
+public:
+    TopProcess(const FakeProcfs& procfs, const std::string& args) {
+        std::string cmd =
+            std::string(TOP_PATH) + " -b --proc-root " + procfs.Root().string() + " " + args;
+        pipe_ = popen(cmd.c_str(), "r");
+        if (pipe_ == nullptr) {
+            throw std::runtime_error("popen failed");
+        }
+    }
+
+    ~TopProcess() {
+        Wait();
+    }
+
+    // Reads one batch-mode frame: the summary, the column header, rows, and a
+    // terminating blank line. Summary lines are kept in Summary().
+    std::vector<Row> ReadFrame() {
+        std::vector<Row> rows;
+        std::string line;
+        summary_.clear();
+        while (ReadLine(line) && line.rfind("PID", 0) != 0 && line.rfind("%CPU", 0) != 0) {
+            summary_.push_back(line);
+        }
+        while (ReadLine(line) && !line.empty()) {
+            std::istringstream iss(line);
+            Row row;
+            std::string field;
+            while (iss >> field) {
+                row.push_back(field);
+            }
+            rows.push_back(row);
+        }
+        return rows;
+    }
+
+    const std::vector<std::string>& Summary() const {
+        return summary_;
+    }
+
+    int Wait() {
+        if (pipe_ == nullptr) {
+            return status_;
+        }
+        status_ = pclose(pipe_);
+        pipe_ = nullptr;
+        return status_;
+    }
+
+private:
+    bool ReadLine(std::string& line) {
+        line.clear();
+        int c;
+        while ((c = fgetc(pipe_)) != EOF && c != '\n') {
+            line += static_cast<char>(c);
+        }
+        return c != EOF || !line.empty();
+    }
+
+    FILE* pipe_ = nullptr;
+    int status_ = -1;
+    std::vector<std::string> summary_;
+};
+
+const Row* FindPid(const std::vector<Row>& rows, int pid) {
+    for (const auto& row : rows) {
+        if (!row.empty() && row[0] == std::to_string(pid)) {
+            return &row;
+        }
+    }
+    return nullptr;
+}
+
+TEST(Top, ShowsFakeProcesses) {
+    FakeProcfs procfs;
+    FakeProcess shell;
+    shell.pid = 100;
+    shell.command = "bash";
+    shell.priority = 20;
+    shell.niceness = 0;
+    shell.vsize = 8192 * 1024;
+    shell.rss_pages = 1024;
+    procfs.Add(shell);
+    FakeProcess daemon = shell;
+    daemon.pid = 200;
+    daemon.command = "sshd";
+    daemon.niceness = 5;
+    procfs.Add(daemon);
+
+    TopProcess top(procfs, "-n 1");
+    std::vector<Row> rows = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(rows.size(), 2);
+
+    const Row* row = FindPid(rows, 100);
+    ASSERT_NE(row, nullptr);
+    EXPECT_EQ((*row)[1], "root");
+    EXPECT_EQ((*row)[2], "20");
+    EXPECT_EQ((*row)[3], "0");
+    EXPECT_EQ((*row)[4], "8192");
+    EXPECT_EQ((*row)[5], std::to_string(1024 * getpagesize() / 1024));
+    EXPECT_EQ((*row)[6], "S");
+    EXPECT_EQ(row->back(), "bash");
+
+    row = FindPid(rows, 200);
+    ASSERT_NE(row, nullptr);
+    EXPECT_EQ((*row)[3], "5");
+    EXPECT_EQ(row->back(), "sshd");
+}
+
+TEST(Top, CommandWithParentheses) {
+    FakeProcfs procfs;
+    FakeProcess process;
+    process.pid = 7;
+    process.command = "(sd-pam)";
+    process.utime = 3;
+    process.rss_pages = 10;
+    procfs.Add(process);
+
+    TopProcess top(procfs, "-n 1");
+    std::vector<Row> rows = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(rows.size(), 1);
+    EXPECT_EQ(rows[0].back(), "(sd-pam)");
+    EXPECT_EQ(rows[0][6], "S");
+}
+
+TEST(Top, RanksByCpuDelta) {
+    FakeProcfs procfs;
+    for (int pid = 1; pid <= 30; ++pid) {
+        FakeProcess process;
+        process.pid = pid;
+        process.utime = 1000;
+        procfs.Add(process);
+    }
+
+    TopProcess top(procfs, "-n 2 -d 0.5");
+    std::vector<Row> first = top.ReadFrame();
+    ASSERT_EQ(first.size(), 25);
+
+    FakeProcess busy = procfs.Processes().at(17);
+    busy.utime += FakeProcfs::kTicksPerSec / 4;
+    procfs.Update(busy);
+
+    std::vector<Row> second = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_FALSE(second.empty());
+    EXPECT_EQ(second[0][0], "17");
+    EXPECT_GT(std::stod(second[0][7]), 0.0);
+    EXPECT_EQ(std::stod(second[1][7]), 0.0);
+}
+
+TEST(Top, SurvivesProcessChurn) {
+    FakeProcfs procfs;
+    procfs.Populate(200);
+    fs::create_directories(procfs.Root() / "99999");
+
+    TopProcess top(procfs, "-n 3 -d 0.2");
+    ASSERT_EQ(top.ReadFrame().size(), 25);
+    procfs.Advance(0.5);
+    ASSERT_EQ(top.ReadFrame().size(), 25);
+    procfs.Advance(0.5);
+    ASSERT_EQ(top.ReadFrame().size(), 25);
+    ASSERT_EQ(top.Wait(), 0);
+}
+
+TEST(Top, SmapsColumns) {
+    FakeProcfs procfs;
+    FakeProcess worker;
+    worker.pid = 300;
+    worker.rss_pages = 1000;
+    worker.pss_kb = 1500;
+    worker.uss_kb = 700;
+    worker.swap_kb = 64;
+    procfs.Add(worker);
+
+    TopProcess top(procfs, "--smaps -n 2 -d 0.2");
+    std::vector<Row> first = top.ReadFrame();
+    ASSERT_EQ(first.size(), 1);
+    EXPECT_EQ(first[0][6], "1500");
+    EXPECT_EQ(first[0][7], "700");
+    EXPECT_EQ(first[0][8], "64");
+
+    // Refreshed on a slower cadence than CPU, so the next frame reuses the cached value.
+    worker.pss_kb = 900;
+    procfs.Update(worker);
+    std::vector<Row> second = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(second.size(), 1);
+    EXPECT_EQ(second[0][6], "1500");
+}
+
+TEST(Top, Filters) {
+    FakeProcfs procfs;
+    const char* commands[] = {"nginx", "nginx", "postgres", "bash", "ngrep"};
+    for (int pid = 1; pid <= 5; ++pid) {
+        FakeProcess process;
+        process.pid = pid;
+        process.command = commands[pid - 1];
+        process.uid = pid % 2;
+        procfs.Add(process);
+    }
+
+    {
+        TopProcess top(procfs, "-n 1 -p 2,3,42");
+        std::vector<Row> rows = top.ReadFrame();
+        ASSERT_EQ(top.Wait(), 0);
+        ASSERT_EQ(rows.size(), 2);
+        EXPECT_NE(FindPid(rows, 2), nullptr);
+        EXPECT_NE(FindPid(rows, 3), nullptr);
+    }
+    {
+        TopProcess top(procfs, "-n 1 --comm '^ng(inx)?$'");
+        std::vector<Row> rows = top.ReadFrame();
+        ASSERT_EQ(top.Wait(), 0);
+        ASSERT_EQ(rows.size(), 2);
+        EXPECT_NE(FindPid(rows, 1), nullptr);
+        EXPECT_NE(FindPid(rows, 2), nullptr);
+    }
+    if (geteuid() == 0) {
+        TopProcess top(procfs, "-n 1 -u 1 --comm ^n");
+        std::vector<Row> rows = top.ReadFrame();
+        ASSERT_EQ(top.Wait(), 0);
+        ASSERT_EQ(rows.size(), 2);
+        EXPECT_NE(FindPid(rows, 1), nullptr);
+        EXPECT_NE(FindPid(rows, 5), nullptr);
+    }
+}
+
+TEST(Top, SystemSummary) {
+    FakeProcfs procfs(256);
+    const char states[] = {'R', 'S', 'S', 'Z', 'T', 'I'};
+    for (int pid = 1; pid <= 6; ++pid) {
+        FakeProcess process;
+        process.pid = pid;
+        process.state = states[pid - 1];
+        procfs.Add(process);
+    }
+
+    TopProcess top(procfs, "-n 2 -d 0.3");
+    top.ReadFrame();
+    procfs.Advance(0);
+    top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+
+    const auto& summary = top.Summary();
+    ASSERT_GE(summary.size(), 5);
+    EXPECT_NE(summary[0].find("load average: 0.50, 0.40, 0.30"), std::string::npos);
+    EXPECT_EQ(summary[1],
+              "Tasks:    6 total,    1 running,    3 sleeping,    1 stopped,    1 zombie");
+    EXPECT_EQ(summary[2].rfind("%Cpu(s):", 0), 0);
+    EXPECT_EQ(summary[3].rfind("MiB Mem :  16384.0 total,   8192.0 free", 0), 0);
+
+    int strips = 0;
+    for (const auto& line : summary) {
+        if (line.rfind("CPU ", 0) == 0) {
+            EXPECT_EQ(line.size(), std::string("CPU   0 []").size() + 64);
+            ++strips;
+        }
+    }
+    EXPECT_EQ(strips, 4);
+
+    // A filtered scan still reports the system's total.
+    TopProcess filtered(procfs, "-n 1 -p 1,2");
+    filtered.ReadFrame();
+    ASSERT_EQ(filtered.Wait(), 0);
+    ASSERT_GE(filtered.Summary().size(), 2);
+    EXPECT_EQ(filtered.Summary()[1], "Tasks:    6 total,    2 shown (filtered)");
+}
+
+TEST(Top, OverheadStatsLine) {
+    FakeProcfs procfs;
+    procfs.Populate(10);
+
+    TopProcess top(procfs, "--overhead -n 2 -d 0.2");
+    top.ReadFrame();
+    std::vector<Row> rows = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(rows.size(), 11);
+
+    const Row& stats = rows.back();
+    ASSERT_EQ(stats[0], "STATS");
+    std::map<std::string, double> values;
+    for (size_t i = 1; i < stats.size(); ++i) {
+        size_t eq = stats[i].find('=');
+        ASSERT_NE(eq, std::string::npos);
+        values[stats[i].substr(0, eq)] = std::stod(stats[i].substr(eq + 1));
+    }
+    for (const char* key : {"scan_ms", "sort_ms", "render_ms", "syscalls", "opens", "bytes_read",
+                            "cpu", "rss_kb"}) {
+        EXPECT_EQ(values.count(key), 1) << key;
+    }
+    // stat and status for each of the ten processes.
+    EXPECT_GE(values["opens"], 20);
+    EXPECT_GT(values["syscalls"], values["opens"]);
+    EXPECT_GT(values["bytes_read"], 0);
+    EXPECT_GT(values["rss_kb"], 0);
+}
+
+TEST(Top, CgroupView) {
+    FakeProcfs procfs;
+    FakeCgroupfs cgroupfs;
+    FakeCgroup web{"/system.slice/web.service", 5'000'000, 256 * 1024 * 1024, {10, 11}};
+    FakeCgroup db{"/system.slice/db.service", 9'000'000, 1024 * 1024 * 1024, {20}};
+    cgroupfs.Write(web);
+    cgroupfs.Write(db);
+
+    TopProcess top(procfs,
+                   "--cgroup --cgroup-root " + cgroupfs.Root().string() + " -n 2 -d 0.5");
+    std::vector<Row> first = top.ReadFrame();
+    ASSERT_EQ(first.size(), 4);  // root, system.slice and both services
+
+    web.usage_usec += 250'000;
+    cgroupfs.Write(web);
+
+    std::vector<Row> second = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(second.size(), 4);
+    EXPECT_EQ(second[0].back(), "/system.slice/web.service");
+    EXPECT_GT(std::stod(second[0][0]), 0.0);
+    EXPECT_EQ(second[0][1], std::to_string(256 * 1024));
+    EXPECT_EQ(second[0][3], "2");
+    EXPECT_EQ(std::stod(second[1][0]), 0.0);
+}
+
+TEST(Top, CgroupDrillDown) {
+    FakeProcfs procfs;
+    FakeCgroupfs cgroupfs;
+    for (int pid = 1; pid <= 5; ++pid) {
+        FakeProcess process;
+        process.pid = pid;
+        procfs.Add(process);
+    }
+    cgroupfs.Write({"/app.slice", 0, 0, {2, 4}});
+
+    TopProcess top(procfs,
+                   "--cgroup-pids /app.slice --cgroup-root " + cgroupfs.Root().string() + " -n 1");
+    std::vector<Row> rows = top.ReadFrame();
+    ASSERT_EQ(top.Wait(), 0);
+    ASSERT_EQ(rows.size(), 2);
+    EXPECT_NE(FindPid(rows, 2), nullptr);
+    EXPECT_NE(FindPid(rows, 4), nullptr);
+}
+
+// Connects to the exporter's unix socket, retrying while top starts up; -1 if
+// it never comes up.
+int ConnectExporter(const std::string& path) {
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    std::strcpy(addr.sun_path, path.c_str());
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) {
+            return fd;
+        }
+        close(fd);
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    }
+    return -1;
+}
+
+std::string Scrape(const std::string& path) {
+    int fd = ConnectExporter(path);
+    if (fd < 0) {
+        return "";
+    }
+    std::string request = "GET /metrics HTTP/1.0\r\n\r\n";
+    write(fd, request.data(), request.size());
+    std::string response;
+    char buffer[4096];
+    ssize_t size;
+    while ((size = read(fd, buffer, sizeof(buffer))) > 0) {
+        response.append(buffer, size);
+    }
+    close(fd);
+    return response;
+}
+
+TEST(Top, MetricsExporter) {
+    FakeProcfs procfs;
+    FakeProcess shell;
+    shell.pid = 100;
+    shell.command = "bash";
+    shell.rss_pages = 1024;
+    procfs.Add(shell);
+    FakeProcess quoted = shell;
+    quoted.pid = 200;
+    quoted.command = "say \"hi\"";
+    quoted.state = 'R';
+    procfs.Add(quoted);
+
+    std::string path = "/tmp/top_test_" + std::to_string(getpid()) + ".sock";
+    TopProcess top(procfs, "--headless --listen unix:" + path + " -n 20 -d 0.1");
+    // Clients that connect and then say nothing must not hold up anyone else.
+    std::vector<int> stalled;
+    for (int i = 0; i < 8; ++i) {
+        stalled.push_back(ConnectExporter(path));
+        ASSERT_GE(stalled.back(), 0);
+    }
+    auto start = std::chrono::steady_clock::now();
+    std::string response = Scrape(path);
+    EXPECT_LT(std::chrono::steady_clock::now() - start, std::chrono::milliseconds(400));
+    for (int fd : stalled) {
+        close(fd);
+    }
+    ASSERT_EQ(top.Wait(), 0);
+
+    size_t header_end = response.find("\r\n\r\n");
+    ASSERT_NE(header_end, std::string::npos) << response;
+    std::string header = response.substr(0, header_end);
+    std::string body = response.substr(header_end + 4);
+    EXPECT_EQ(header.rfind("HTTP/1.0 200 OK\r\n", 0), 0u) << header;
+    EXPECT_NE(header.find("Content-Type: text/plain; version=0.0.4"), std::string::npos);
+    EXPECT_NE(header.find("Content-Length: " + std::to_string(body.size())), std::string::npos);
+
+    // Every sample belongs to a metric whose HELP and TYPE came before it.
+    std::set<std::string> typed;
+    std::map<std::string, std::string> samples;
+    std::istringstream lines(body);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.rfind("# HELP ", 0) == 0) {
+            continue;
+        }
+        if (line.rfind("# TYPE ", 0) == 0) {
+            std::istringstream fields(line.substr(7));
+            std::string name, type;
+            fields >> name >> type;
+            EXPECT_EQ(type, "gauge") << line;
+            typed.insert(name);
+            continue;
+        }
+        size_t space = line.rfind(' ');
+        ASSERT_NE(space, std::string::npos) << line;
+        std::string series = line.substr(0, space);
+        EXPECT_EQ(typed.count(series.substr(0, series.find('{'))), 1u) << line;
+        size_t parsed = 0;
+        std::stod(line.substr(space + 1), &parsed);
+        EXPECT_EQ(parsed, line.size() - space - 1) << line;
+        samples[series] = line.substr(space + 1);
+    }
+
+    std::string resident = std::to_string(1024 * getpagesize() / 1024);
+    EXPECT_EQ(samples["top_process_resident_kilobytes{pid=\"100\",user=\"root\",comm=\"bash\"}"],
+              resident);
+    EXPECT_EQ(samples.count("top_process_cpu_percent{pid=\"200\",user=\"root\","
+                            "comm=\"say \\\"hi\\\"\"}"),
+              1u);
+    EXPECT_EQ(samples["top_processes{state=\"R\"}"], "1");
+    EXPECT_EQ(samples["top_processes{state=\"S\"}"], "1");
+    EXPECT_EQ(samples["top_user_processes{user=\"root\",state=\"S\"}"], "1");
 }